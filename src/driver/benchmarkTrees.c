@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include "util/ParseCommandLine.h"
+#include "heap/Heap.h"
+#include "model/trees/TreeBuilder.h"
+#include "model/trees/Cascade.h"
+
+/**
+ * Times VPred (findLeaf) on a tree model, over random instances whose
+ * feature values are uniform in [0, 1). Instances are split into queries
+ * of "candidates" instances, of which the top "hits" are kept. With
+ * -cascade, instances that cannot make it into the top hits are dropped
+ * every "checkpoint" trees (see model/trees/Cascade.h).
+ *
+ * Usage: benchmarkTrees -model <model> -features <number of features>
+ *                       [-instances <n>] [-candidates <c>] [-hits <k>]
+ *                       [-cascade] [-checkpoint <trees>] [-repeat <r>]
+ */
+int main (int argc, char** args) {
+  if(!isPresentCL(argc, args, "-model") || !isPresentCL(argc, args, "-features")) {
+    printf("Usage: benchmarkTrees -model <model> -features <number of features> ");
+    printf("[-instances <n>] [-candidates <c>] [-hits <k>] ");
+    printf("[-cascade] [-checkpoint <trees>] [-repeat <r>]\n");
+    return -1;
+  }
+  int numberOfFeatures = atoi(getValueCL(argc, args, "-features"));
+  int numberOfInstances = 100000;
+  if(isPresentCL(argc, args, "-instances")) {
+    numberOfInstances = atoi(getValueCL(argc, args, "-instances"));
+  }
+  int candidates = 1000;
+  if(isPresentCL(argc, args, "-candidates")) {
+    candidates = atoi(getValueCL(argc, args, "-candidates"));
+  }
+  int hits = 10;
+  if(isPresentCL(argc, args, "-hits")) {
+    hits = atoi(getValueCL(argc, args, "-hits"));
+  }
+  int interval = DEFAULT_CASCADE_INTERVAL;
+  if(isPresentCL(argc, args, "-checkpoint")) {
+    interval = atoi(getValueCL(argc, args, "-checkpoint"));
+  }
+  if(hits <= 0 || interval <= 0) {
+    printf("-hits and -checkpoint must be greater than 0\n");
+    printf("Usage: benchmarkTrees -model <model> -features <number of features> ");
+    printf("[-instances <n>] [-candidates <c>] [-hits <k>] ");
+    printf("[-cascade] [-checkpoint <trees>] [-repeat <r>]\n");
+    return -1;
+  }
+  int repeat = 5;
+  if(isPresentCL(argc, args, "-repeat")) {
+    repeat = atoi(getValueCL(argc, args, "-repeat"));
+  }
+  // Rounded up to a multiple of V, as findLeaf reads V instances at a time
+  candidates = ((candidates + V - 1) / V) * V;
+  numberOfInstances = ((numberOfInstances + candidates - 1) / candidates) * candidates;
+
+  TreeModel* model = parseTrees(getValueCL(argc, args, "-model"));
+  Cascade* cascade = NULL;
+  if(isPresentCL(argc, args, "-cascade")) {
+    cascade = createCascade(model, hits, interval);
+  }
+
+  srand(1);
+  float* features = (float*) malloc((long) numberOfInstances * numberOfFeatures * sizeof(float));
+  long i;
+  for(i = 0; i < (long) numberOfInstances * numberOfFeatures; i++) {
+    features[i] = rand() / (RAND_MAX + 1.0f);
+  }
+  float* scores = (float*) malloc(candidates * sizeof(float));
+  // The cascade moves the instances of a query around, so it works on a copy
+  float* queryFeatures = (float*) malloc((long) candidates * numberOfFeatures * sizeof(float));
+  int* set = (int*) malloc(candidates * sizeof(int));
+  Heap* topHits = initHeap(hits);
+
+  // Report the fastest of all runs. The checksum adds up the scores of
+  // the top hits of each query.
+  double best = -1, checksum = 0;
+  long remaining = 0, evaluations = (long) numberOfInstances * model->nbTrees;
+  int r, q, t, j, leaf[V];
+  for(r = 0; r < repeat; r++) {
+    checksum = 0;
+    remaining = 0;
+    if(cascade) {
+      cascade->evaluations = 0;
+    }
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    for(q = 0; q < numberOfInstances; q += candidates) {
+      float* x = &features[(long) q * numberOfFeatures];
+      int n = candidates;
+      if(cascade) {
+        memcpy(queryFeatures, x, (long) candidates * numberOfFeatures * sizeof(float));
+        for(j = 0; j < candidates; j++) {
+          set[j] = j + 1;
+        }
+        n = scoreCascade(cascade, model, queryFeatures, numberOfFeatures,
+                         candidates, set, scores);
+      } else {
+        for(i = 0; i < candidates; i += V) {
+          for(j = 0; j < V; j++) {
+            scores[i + j] = 0;
+          }
+          for(t = 0; t < model->nbTrees; t++) {
+            findLeaf[model->treeDepths[t]](leaf, &x[i * numberOfFeatures],
+                                           numberOfFeatures,
+                                           &model->nodes[model->nodeSizes[t]]);
+            for(j = 0; j < V; j++) {
+              scores[i + j] += model->nodes[model->nodeSizes[t] + leaf[j]].theta;
+            }
+          }
+        }
+      }
+      remaining += n;
+
+      clearHeap(topHits);
+      for(j = 0; j < n; j++) {
+        insertHeap(topHits, j, scores[j]);
+      }
+      for(j = 1; j <= topHits->index; j++) {
+        checksum += topHits->score[j];
+      }
+    }
+    gettimeofday(&end, NULL);
+    double elapsed = ((end.tv_sec * 1000000 + end.tv_usec) -
+                      (start.tv_sec * 1000000 + start.tv_usec));
+    if(best < 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+
+  printf("trees: %d instances: %d time: %.0f us (%.3f us per instance) ",
+         model->nbTrees, numberOfInstances, best, best / numberOfInstances);
+  if(cascade) {
+    evaluations = cascade->evaluations;
+  }
+  printf("remaining: %ld tree evaluations: %ld checksum: %f\n", remaining, evaluations, checksum);
+
+  free(features);
+  free(scores);
+  free(queryFeatures);
+  free(set);
+  destroyHeap(topHits);
+  if(cascade) destroyCascade(cascade);
+  destroyTreeModel(model);
+  return 0;
+}
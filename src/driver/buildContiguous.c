@@ -10,6 +10,7 @@
 #include "util/ParseCommandLine.h"
 #include "SegmentPool.h"
 #include "DocumentVector.h"
+#include "ForwardIndex.h"
 #include "Pointers.h"
 #include "Config.h"
 
@@ -118,6 +119,25 @@ int main (int argc, char** args) {
     destroyDocumentVector(vectors);
   }
 
+  // Copy the forward index
+  char forwardPath[1024];
+  strcpy(forwardPath, inputPath);
+  strcat(forwardPath, "/");
+  strcat(forwardPath, FORWARD_INDEX_FILE);
+  if(!access(forwardPath, F_OK)) {
+    fp = fopen(forwardPath, "rb");
+    ForwardIndex* forward = readForwardIndex(fp);
+    fclose(fp);
+
+    strcpy(forwardPath, outputPath);
+    strcat(forwardPath, "/");
+    strcat(forwardPath, FORWARD_INDEX_FILE);
+    fp = fopen(forwardPath, "wb");
+    writeForwardIndex(forward, fp);
+    fclose(fp);
+    destroyForwardIndex(forward);
+  }
+
   destroyDictionary(dic);
   destroySegmentPool(contiguousPool);
   destroyPointers(pointers);
@@ -102,7 +102,9 @@ int process(InvertedIndex* index, IndexingData* data, char* line, int termid) {
   docid = atoi(line);
   line += consumed;
 
-  if(indexDocumentVectors(index)) {
+  // The raw document is kept for document vectors and the forward index
+  int keepDocument = indexDocumentVectors(index) || indexForwardIndex(index);
+  if(keepDocument) {
     resetFixedBuffer(data->document);
   }
 
@@ -125,7 +127,7 @@ int process(InvertedIndex* index, IndexingData* data, char* line, int termid) {
     long cf = getCf(index->pointers, id);
     index->pointers->cf->counter[id]++;
 
-    if(indexDocumentVectors(index)) {
+    if(keepDocument) {
       setFixedBuffer(data->document, position - 1, id);
     }
 
@@ -200,6 +202,9 @@ int process(InvertedIndex* index, IndexingData* data, char* line, int termid) {
   if(indexDocumentVectors(index)) {
     addDocumentVector(index->vectors, data->document->buffer, position, docid);
   }
+  if(indexForwardIndex(index)) {
+    addForwardIndex(index->forward, data->document->buffer, position, docid);
+  }
 
   // Iterate over all unique terms
   int keyPos = -1;
@@ -296,17 +301,18 @@ int process(InvertedIndex* index, IndexingData* data, char* line, int termid) {
       if(nb == 1) {
         if(data->positional == TFONLY) {
           pointer = compressAndAddTfOnly(index->pool, curBuffer, data->buffer->tf[id],
-                                         BLOCK_SIZE, pointer);
+                                         BLOCK_SIZE, getDf(index->pointers, id), pointer);
         } else if(data->positional == POSITIONAL) {
           pointer = compressAndAddPositional(index->pool, curBuffer, data->buffer->tf[id],
                                              // The first index (0) holds the number
                                              // of positions in the block
                                              &data->buffer->position[id][1],
                                              BLOCK_SIZE, data->buffer->position[id][0],
-                                             pointer);
+                                             getDf(index->pointers, id), pointer);
         } else {
           pointer = compressAndAddNonPositional(index->pool, curBuffer,
-                                                BLOCK_SIZE, pointer);
+                                                BLOCK_SIZE, getDf(index->pointers, id),
+                                                pointer);
         }
         // If no head pointer exists
         if(index->pool->reverse || getHeadPointer(index->pointers, id) == UNDEFINED_POINTER) {
@@ -318,18 +324,19 @@ int process(InvertedIndex* index, IndexingData* data, char* line, int termid) {
           if(data->positional == TFONLY) {
             pointer = compressAndAddTfOnly(index->pool, &curBuffer[j * BLOCK_SIZE],
                                            &data->buffer->tf[id][j * BLOCK_SIZE],
-                                           BLOCK_SIZE, pointer);
+                                           BLOCK_SIZE, getDf(index->pointers, id), pointer);
           } else if(data->positional == POSITIONAL) {
             // The number of positions in the current block is stored at index "ps"
             pointer = compressAndAddPositional(index->pool, &curBuffer[j * BLOCK_SIZE],
                                                &data->buffer->tf[id][j * BLOCK_SIZE],
                                                &data->buffer->position[id][ps + 1],
                                                BLOCK_SIZE, data->buffer->position[id][ps],
-                                               pointer);
+                                               getDf(index->pointers, id), pointer);
             ps += data->buffer->position[id][ps] + 1;
           } else {
             pointer = compressAndAddNonPositional(index->pool, &curBuffer[j * BLOCK_SIZE],
-                                                  BLOCK_SIZE, pointer);
+                                                  BLOCK_SIZE, getDf(index->pointers, id),
+                                                  pointer);
           }
           if(index->pool->reverse || getHeadPointer(index->pointers, id) == UNDEFINED_POINTER) {
             setHeadPointer(index->pointers, id, pointer);
@@ -415,12 +422,31 @@ int main (int argc, char** args) {
   } else if(isPresentCL(argc, args, "-tf")) {
     positional = TFONLY;
   }
-  // Whether to store Bloom filter representation of docids
-  int bloomEnabled = isPresentCL(argc, args, "-bloom");
+  // Whether to store Bloom filter representation of docids,
+  // and whether to use cache-line blocked filters.
+  // With "-fpr", filters are sized per term from a target
+  // false positive rate instead of a fixed "-r" and "-k"
+  int bloomEnabled = 0;
   unsigned int nbHash, bitsPerElement;
-  if(bloomEnabled) {
-    nbHash = atoi(getValueCL(argc, args, "-k"));
-    bitsPerElement = atoi(getValueCL(argc, args, "-r"));
+  float targetFpr = 0;
+  if(isPresentCL(argc, args, "-bloom")) {
+    if(isPresentCL(argc, args, "-fpr")) {
+      targetFpr = atof(getValueCL(argc, args, "-fpr"));
+      bitsPerElement = computeBitsPerElement(targetFpr);
+    } else {
+      bitsPerElement = atoi(getValueCL(argc, args, "-r"));
+    }
+    if(isPresentCL(argc, args, "-blocked")) {
+      // Blocked filters set one bit in each word of a block
+      bloomEnabled = BLOOM_FILTER_BLOCKED;
+      nbHash = BLOCKED_BLOOM_FILTER_WORDS;
+    } else if(targetFpr > 0) {
+      bloomEnabled = BLOOM_FILTER_CLASSIC;
+      nbHash = ADAPTIVE_NB_HASH;
+    } else {
+      bloomEnabled = BLOOM_FILTER_CLASSIC;
+      nbHash = atoi(getValueCL(argc, args, "-k"));
+    }
   }
 
   int reverse = 0;
@@ -433,6 +459,21 @@ int main (int argc, char** args) {
     documentVectors = 1;
   }
 
+  // Whether to store the term frequencies of every document
+  int forwardIndex = 0;
+  if(isPresentCL(argc, args, "-forward")) {
+    forwardIndex = 1;
+  }
+
+  // Whether to store dense docid blocks as bitmap containers
+  float bitmapDensity = 0;
+  if(isPresentCL(argc, args, "-bitmap")) {
+    bitmapDensity = BITMAP_CONTAINER_DENSITY;
+    if(isPresentCL(argc, args, "-bitmapDensity")) {
+      bitmapDensity = atof(getValueCL(argc, args, "-bitmapDensity"));
+    }
+  }
+
   int dfCutoff = DF_CUTOFF;
   if(isPresentCL(argc, args, "-dfCutoff")) {
     dfCutoff = atoi(getValueCL(argc, args, "-dfCutoff"));
@@ -442,8 +483,10 @@ int main (int argc, char** args) {
   int inputBeginIndex = isPresentCL(argc, args, "-input") + 1;
 
   // Creating and initializing the inverted index and its auxiliary data structures
-  InvertedIndex* index = createInvertedIndex(reverse, documentVectors,
+  InvertedIndex* index = createInvertedIndex(reverse, documentVectors, forwardIndex,
                                              bloomEnabled, nbHash, bitsPerElement);
+  index->pool->targetFpr = targetFpr;
+  index->pool->bitmapDensity = bitmapDensity;
   IndexingData* data = (IndexingData*) malloc(sizeof(IndexingData));
   data->buffer = createBufferMaps(DEFAULT_VOCAB_SIZE, positional);
   if(positional == POSITIONAL) {
@@ -560,19 +603,19 @@ int main (int argc, char** args) {
           pointer =
             compressAndAddTfOnly(index->pool, &curBuffer[j * BLOCK_SIZE],
                                  &data->buffer->tf[term][j * BLOCK_SIZE],
-                                 BLOCK_SIZE, pointer);
+                                 BLOCK_SIZE, getDf(index->pointers, term), pointer);
         } else if(positional == POSITIONAL) {
           pointer =
             compressAndAddPositional(index->pool, &curBuffer[j * BLOCK_SIZE],
                                      &data->buffer->tf[term][j * BLOCK_SIZE],
                                      &data->buffer->position[term][ps + 1],
                                      BLOCK_SIZE, data->buffer->position[term][ps],
-                                     pointer);
+                                     getDf(index->pointers, term), pointer);
           ps += data->buffer->position[term][ps] + 1;
         } else {
           pointer =
             compressAndAddNonPositional(index->pool, &curBuffer[j * BLOCK_SIZE],
-                                        BLOCK_SIZE, pointer);
+                                        BLOCK_SIZE, getDf(index->pointers, term), pointer);
         }
         if(index->pool->reverse || getHeadPointer(index->pointers, term) == UNDEFINED_POINTER) {
           setHeadPointer(index->pointers, term, pointer);
@@ -584,18 +627,18 @@ int main (int argc, char** args) {
           pointer =
             compressAndAddTfOnly(index->pool, &curBuffer[nb * BLOCK_SIZE],
                                  &data->buffer->tf[term][nb * BLOCK_SIZE],
-                                 res, pointer);
+                                 res, getDf(index->pointers, term), pointer);
         } else if(positional == POSITIONAL) {
           pointer =
             compressAndAddPositional(index->pool, &curBuffer[nb * BLOCK_SIZE],
                                      &data->buffer->tf[term][nb * BLOCK_SIZE],
                                      &data->buffer->position[term][ps + 1],
                                      res, data->buffer->position[term][ps],
-                                     pointer);
+                                     getDf(index->pointers, term), pointer);
         } else {
           pointer =
             compressAndAddNonPositional(index->pool, &curBuffer[nb * BLOCK_SIZE],
-                                        res, pointer);
+                                        res, getDf(index->pointers, term), pointer);
         }
         if(index->pool->reverse || getHeadPointer(index->pointers, term) == UNDEFINED_POINTER) {
           setHeadPointer(index->pointers, term, pointer);
@@ -12,18 +12,27 @@
 #include "Pointers.h"
 #include "Config.h"
 #include "InvertedIndex.h"
+#include "QueryContext.h"
 #include "intersection/SvS.h"
 #include "intersection/WAND.h"
+#include "intersection/MaxScore.h"
+#include "intersection/RankedAnd.h"
+#include "intersection/BooleanQuery.h"
 #include "heap/Heap.h"
 #include "intersection/BWAND_AND.h"
 #include "intersection/BWAND_OR.h"
 #include "scorer/ScoringFunction.h"
 #include "scorer/BM25.h"
 #include "scorer/Dirichlet.h"
+#include "feature/WindowCounts.h"
+#include "feature/FeatureExtractor.h"
 #include "feature/TermFeature.h"
 #include "feature/OrderedWindowSequentialDependenceFeature.h"
 #include "feature/UnorderedWindowSequentialDependenceFeature.h"
 #include "model/trees/TreeBuilder.h"
+#include "model/trees/QuickScorer.h"
+#include "model/trees/CompiledModel.h"
+#include "model/trees/Cascade.h"
 
 #ifndef RETRIEVAL_ALGO_ENUM_GUARD
 #define RETRIEVAL_ALGO_ENUM_GUARD
@@ -34,21 +43,18 @@ enum Algorithm {
   MBWAND = 2, // Disjunctive query evaluation using WAND_IDF
   BWAND_OR = 3, // Disjunctive BWAND
   BWAND_AND = 4, // Conjunctive BWAND
+  MAXSCORE = 5, // Disjunctive query evaluation using MaxScore
+  RANKED_AND = 6, // Conjunctive top-k query evaluation using block maxima
+  BOOLEAN = 7, // Structured (Boolean) queries, see query/QueryParser.h
 };
-#endif
 
-/**
- * Pointers to feature computation functions.
- *
- * @param positions List of positions for every query term
- * @param query List of query terms
- * @param qlength Number of query terms
- * @param docid Document id of the document to extract features for
- * @param pointers Dictionary Pointers
- * @param scorer Scoring function
- */
-typedef float (*computeFeature)(int** positions, int* query, int qlength, int docid,
-                                Pointers* pointers, ScoringFunction* scorer);
+typedef enum TreeEvaluator TreeEvaluator;
+enum TreeEvaluator {
+  VPRED = 0, // Trees are traversed one at a time, V instances at once
+  QUICK_SCORER = 1, // Nodes are visited feature by feature, see model/trees/QuickScorer.h
+  COMPILED = 2, // Trees are compiled into a shared object, see model/trees/CompiledModel.h
+};
+#endif
 
 int main (int argc, char** args) {
   // Index path
@@ -64,6 +70,13 @@ int main (int argc, char** args) {
     hitsSpecified = 1;
     hits = atoi(getValueCL(argc, args, "-hits"));
   }
+  // BWAND_AND: remove Bloom filter false positives from the result
+  int exact = isPresentCL(argc, args, "-exact");
+  // Number of threads to extract features with
+  int numberOfThreads = 1;
+  if(isPresentCL(argc, args, "-threads")) {
+    numberOfThreads = atoi(getValueCL(argc, args, "-threads"));
+  }
   // Algorithm
   char* intersectionAlgorithm = getValueCL(argc, args, "-algorithm");
   Algorithm algorithm = SVS;
@@ -78,14 +91,70 @@ int main (int argc, char** args) {
     algorithm = BWAND_OR;
   } else if(!strcmp(intersectionAlgorithm, "BWAND_AND")) {
     algorithm = BWAND_AND;
+  } else if(!strcmp(intersectionAlgorithm, "MaxScore")) {
+    algorithm = MAXSCORE;
+  } else if(!strcmp(intersectionAlgorithm, "RankedAND")) {
+    algorithm = RANKED_AND;
+  } else if(!strcmp(intersectionAlgorithm, "Boolean")) {
+    algorithm = BOOLEAN;
   } else {
     printf("Invalid algorithm (Options: SvS | WAND | ");
-    printf("MBWAND | BWAND_OR | BWAND_AND)\n");
-    return;
+    printf("MBWAND | BWAND_OR | BWAND_AND | MaxScore | RankedAND | Boolean)\n");
+    return 1;
+  }
+  // Tree ensemble evaluation
+  TreeEvaluator evaluator = VPRED;
+  if(isPresentCL(argc, args, "-evaluator")) {
+    char* evaluatorName = getValueCL(argc, args, "-evaluator");
+    if(!strcmp(evaluatorName, "VPred")) {
+      evaluator = VPRED;
+    } else if(!strcmp(evaluatorName, "QuickScorer")) {
+      evaluator = QUICK_SCORER;
+    } else if(!strcmp(evaluatorName, "Compiled")) {
+      evaluator = COMPILED;
+    } else {
+      printf("Invalid evaluator (Options: VPred | QuickScorer | Compiled)\n");
+      return 1;
+    }
+  }
+  // Cascade: keep only the top k instances, pruning every "checkpoint" trees
+  int cascadeK = 0;
+  int cascadeInterval = DEFAULT_CASCADE_INTERVAL;
+  if(isPresentCL(argc, args, "-cascade")) {
+    cascadeK = atoi(getValueCL(argc, args, "-cascade"));
+    if(cascadeK <= 0) {
+      printf("Invalid cascade (Usage: -cascade <number of results > 0>)\n");
+      return 1;
+    }
+    if(evaluator != VPRED) {
+      printf("-cascade requires the VPred evaluator\n");
+      return 1;
+    }
+  }
+  if(isPresentCL(argc, args, "-checkpoint")) {
+    cascadeInterval = atoi(getValueCL(argc, args, "-checkpoint"));
+    if(cascadeInterval <= 0) {
+      printf("Invalid checkpoint (Usage: -checkpoint <number of trees > 0>)\n");
+      return 1;
+    }
+  }
+  // Directory of compiled models ($HOME/DEFAULT_COMPILED_MODEL_CACHE by default)
+  char* modelCache = NULL;
+  if(isPresentCL(argc, args, "-modelCache")) {
+    modelCache = getValueCL(argc, args, "-modelCache");
   }
 
   // Read the inverted index
   InvertedIndex* index = readInvertedIndex(inputPath);
+  if(algorithm == RANKED_AND || algorithm == BOOLEAN) {
+    if(!isTermFrequencyPresent(index->pool)) {
+      printf("%s requires an index with term frequencies\n", intersectionAlgorithm);
+      return 1;
+    }
+  }
+  if(algorithm == RANKED_AND) {
+    buildBlockMaxLists(index);
+  }
 
   // Docno-Docid Mapping
   char** docnoMapping = NULL;
@@ -103,12 +172,15 @@ int main (int argc, char** args) {
 
   // Feature extraction: read and parse features
   computeFeature* extractors = NULL;
+  WindowCounts* windowCounts = NULL;
+  FeatureExtractor* featureExtractor = NULL;
   ScoringFunction* scorers = NULL;
   float** staticFeatures = NULL;
   int numberOfFeatures = 0;
   int numberOfStaticFeatures = 0;
   int totalFeatures = 0;
-  if(index->vectors && isPresentCL(argc, args, "-features")) {
+  if((index->vectors || index->forward || isPositional(index->pool)) &&
+     isPresentCL(argc, args, "-features")) {
     char* featurePath = getValueCL(argc, args, "-features");
     FILE* fp = fopen(featurePath, "r");
     int f;
@@ -116,6 +188,7 @@ int main (int argc, char** args) {
 
     fscanf(fp, "%d", &numberOfFeatures);
     extractors = calloc(numberOfFeatures, sizeof(computeFeature));
+    windowCounts = createWindowCounts();
     scorers = calloc(numberOfFeatures, sizeof(ScoringFunction));
     for(f = 0; f < numberOfFeatures; f++) {
       fscanf(fp, "%s", featureInputText);
@@ -147,11 +220,13 @@ int main (int argc, char** args) {
       } else if(!strcmp(featureInputText, "OD")) {
         extractors[f] = computeOrderedWindowSDFeature;
         fscanf(fp, "%[ ]%[^:]:%d", featureInputText, featureInputText, &scorers[f].phrase);
+        addOrderedWindowCounts(windowCounts, scorers[f].phrase);
       } else if(!strcmp(featureInputText, "UW")) {
         extractors[f] = computeUnorderedWindowSDFeature;
         int window;
         fscanf(fp, "%[ ]%[^:]:%d", featureInputText, featureInputText, &window);
         scorers[f].phrase = window * 2;
+        addUnorderedWindowCounts(windowCounts, scorers[f].phrase);
       }
     }
 
@@ -168,14 +243,37 @@ int main (int argc, char** args) {
     }
 
     totalFeatures = numberOfFeatures + numberOfStaticFeatures;
+    featureExtractor = createFeatureExtractor(index, extractors, scorers, numberOfFeatures,
+                                              windowCounts, staticFeatures,
+                                              numberOfStaticFeatures, numberOfThreads);
+    if(!canExtractFeatures(featureExtractor)) {
+      printf("Features other than Term require document vectors or a positional index\n");
+      destroyFeatureExtractor(featureExtractor);
+      return 1;
+    }
   }
 
-  // Read LambdaMART model (evaluation is done using VPred)
+  // Read LambdaMART model (evaluation is done using VPred, QuickScorer,
+  // or compiled code)
   TreeModel* treeModel = NULL;
+  QuickScorer* quickScorer = NULL;
+  CompiledModel* compiledModel = NULL;
+  Cascade* cascade = NULL;
   float* scores = NULL;
   Heap* rankedList = initHeap(hits);
   if(isPresentCL(argc, args, "-model")) {
     treeModel = parseTrees(getValueCL(argc, args, "-model"));
+    if(evaluator == QUICK_SCORER) {
+      quickScorer = createQuickScorer(treeModel);
+    } else if(evaluator == COMPILED) {
+      compiledModel = createCompiledModel(treeModel, modelCache);
+      if(!compiledModel) {
+        printf("Could not compile the model into %s, falling back to VPred\n",
+               modelCache ? modelCache : "$HOME/" DEFAULT_COMPILED_MODEL_CACHE);
+      }
+    } else if(cascadeK > 0) {
+      cascade = createCascade(treeModel, cascadeK, cascadeInterval);
+    }
   }
 
   int nb = hits;
@@ -188,6 +286,8 @@ int main (int argc, char** args) {
   // Read queries. Query file must be in the following format:
   // - First line: <number of queries: integer>
   // - <query id: integer> <query length: integer> <query text: string>
+  // or, for Boolean queries:
+  // - <query id: integer> <structured query: rest of the line>
   // Note that, if a query term does not have a corresponding postings list,
   // then we drop the query term from the query. Empty queries are not evaluated.
   FixedIntCounter* queryLength = createFixedIntCounter(32768, 0);
@@ -197,7 +297,29 @@ int main (int argc, char** args) {
   char query[1024];
   fscanf(fp, "%d", &totalQueries);
   unsigned int** queries = (unsigned int**) malloc(totalQueries * sizeof(unsigned int*));
+  QueryNode** queryTrees = NULL;
+  if(algorithm == BOOLEAN) {
+    queryTrees = (QueryNode**) calloc(totalQueries, sizeof(QueryNode*));
+  }
   for(i = 0; i < totalQueries; i++) {
+    if(algorithm == BOOLEAN) {
+      fscanf(fp, "%d", &id);
+      fgets(query, 1024, fp);
+      queryTrees[i] = parseQuery(query, index->dictionary, index->pointers);
+      // Terms of the query, to extract features
+      queries[i] = (unsigned int*) malloc(strlen(query) * sizeof(unsigned int));
+      fqlen = 0;
+      if(!queryTrees[i]) {
+        printf("Invalid query: %d\n", id);
+      } else if(requiresPositions(queryTrees[i]) && !isPositional(index->pool)) {
+        printf("Phrases and windows require a positional index, query: %d\n", id);
+      } else {
+        fqlen = collectQueryTerms(queryTrees[i], (int*) queries[i], 0, strlen(query));
+      }
+      setFixedIntCounter(idToIndexMap, id, i);
+      setFixedIntCounter(queryLength, id, fqlen);
+      continue;
+    }
     fscanf(fp, "%d %d", &id, &qlen);
     queries[i] = (unsigned int*) malloc(qlen * sizeof(unsigned int));
     pos = 0;
@@ -224,6 +346,9 @@ int main (int argc, char** args) {
     fp = fopen(outputPath, "w");
   }
 
+  // Scratch memory for query evaluation, reset before every query
+  QueryContext* context = createQueryContext(DEFAULT_CONTEXT_SIZE);
+
   // Evaluate queries by iterating over the queries that are not empty
   id = -1;
   while((id = nextIndexFixedIntCounter(queryLength, id)) != -1) {
@@ -234,9 +359,14 @@ int main (int argc, char** args) {
     qlen = queryLength->counter[id];
     int qindex = idToIndexMap->counter[id];
 
-    unsigned int* qdf = (unsigned int*) calloc(qlen, sizeof(unsigned int));
-    int* sortedDfIndex = (int*) calloc(qlen, sizeof(int));
-    long* qHeadPointers = (long*) calloc(qlen, sizeof(long));
+    resetQueryContext(context);
+    unsigned int* qdf = (unsigned int*)
+      allocateQueryContext(context, qlen * sizeof(unsigned int));
+    int* sortedDfIndex = (int*) allocateQueryContext(context, qlen * sizeof(int));
+    long* qHeadPointers = (long*) allocateQueryContext(context, qlen * sizeof(long));
+    SkipList** qSkipLists = (SkipList**) allocateQueryContext(context, qlen * sizeof(SkipList*));
+    BlockMaxList** qBlockMaxLists = (BlockMaxList**)
+      allocateQueryContext(context, qlen * sizeof(BlockMaxList*));
 
     qdf[0] = getDf(index->pointers, queries[qindex][0]);
     unsigned int minimumDf = qdf[0];
@@ -249,7 +379,7 @@ int main (int argc, char** args) {
 
     // Sort query terms w.r.t. df
     if(algorithm == SVS || algorithm == BWAND_AND ||
-       algorithm == BWAND_OR) {
+       algorithm == BWAND_OR || algorithm == RANKED_AND) {
       for(i = 0; i < qlen; i++) {
         unsigned int minDf = 0xFFFFFFFF;
         for(j = 0; j < qlen; j++) {
@@ -269,6 +399,8 @@ int main (int argc, char** args) {
     for(i = 0; i < qlen; i++) {
       qHeadPointers[i] = getHeadPointer(index->pointers,
                                         queries[qindex][sortedDfIndex[i]]);
+      qSkipLists[i] = getSkipList(index, queries[qindex][sortedDfIndex[i]]);
+      qBlockMaxLists[i] = getBlockMaxList(index, queries[qindex][sortedDfIndex[i]]);
       qdf[i] = getDf(index->pointers, queries[qindex][sortedDfIndex[i]]);
     }
 
@@ -278,13 +410,13 @@ int main (int argc, char** args) {
       if(!hitsSpecified) {
         hits = minimumDf;
       }
-      set = intersectSvS(index->pool, qHeadPointers, qlen, minimumDf, hits);
-    } else if(algorithm == WAND || algorithm == MBWAND) {
-      float* UB = (float*) malloc(qlen * sizeof(float));
+      set = intersectSvS(index->pool, qHeadPointers, qlen, minimumDf, hits, context);
+    } else if(algorithm == WAND || algorithm == MBWAND || algorithm == MAXSCORE) {
+      float* UB = (float*) allocateQueryContext(context, qlen * sizeof(float));
       for(i = 0; i < qlen; i++) {
         int tf = getMaxTf(index->pointers, queries[qindex][sortedDfIndex[i]]);
         int dl = getMaxTfDocLen(index->pointers, queries[qindex][sortedDfIndex[i]]);
-        if(algorithm == WAND) {
+        if(algorithm != MBWAND) {
           UB[i] = _default_bm25(tf, qdf[i],
                                 index->pointers->totalDocs, dl,
                                 index->pointers->totalDocLen /
@@ -293,69 +425,61 @@ int main (int argc, char** args) {
           UB[i] = idf(index->pointers->totalDocs, qdf[i]);
         }
       }
-      set = wand(index->pool, qHeadPointers, qdf, UB, qlen,
-                 index->pointers->docLen->counter,
-                 index->pointers->totalDocs,
-                 index->pointers->totalDocLen / (float) index->pointers->totalDocs,
-                 hits, algorithm == MBWAND, &scores);
-      free(UB);
+      if(algorithm == MAXSCORE) {
+        set = maxScore(index->pool, qHeadPointers, (int*) qdf, UB, qlen,
+                       index->pointers->docLen->counter,
+                       index->pointers->totalDocs,
+                       index->pointers->totalDocLen / (float) index->pointers->totalDocs,
+                       hits, &scores, context);
+      } else {
+        set = wand(index->pool, qHeadPointers, qdf, UB, qlen,
+                   index->pointers->docLen->counter,
+                   index->pointers->totalDocs,
+                   index->pointers->totalDocLen / (float) index->pointers->totalDocs,
+                   hits, algorithm == MBWAND, &scores, context);
+      }
     } else if(algorithm == BWAND_OR) {
-      float* UB = (float*) malloc(qlen * sizeof(float));
+      float* UB = (float*) allocateQueryContext(context, qlen * sizeof(float));
       for(i = 0; i < qlen; i++) {
         UB[i] = idf(index->pointers->totalDocs, qdf[i]);
       }
-      set = bwandOr(index->pool, qHeadPointers, UB, qlen, hits, &scores);
-      free(UB);
+      set = bwandOr(index->pool, qHeadPointers, qSkipLists, UB, qlen, hits, &scores, context);
     } else if(algorithm == BWAND_AND) {
       if(!hitsSpecified) {
         hits = minimumDf;
       }
-      set = bwandAnd(index->pool, qHeadPointers, qlen, hits);
+      set = bwandAnd(index->pool, qHeadPointers, qSkipLists, qlen, hits, exact, context);
+    } else if(algorithm == RANKED_AND) {
+      set = rankedAnd(index->pool, qBlockMaxLists, (int*) qdf, qlen,
+                      index->pointers->docLen->counter,
+                      index->pointers->totalDocs,
+                      index->pointers->totalDocLen / (float) index->pointers->totalDocs,
+                      hits, &scores, context);
+    } else if(algorithm == BOOLEAN) {
+      set = evaluateBooleanQuery(index->pool, queryTrees[qindex], index->pointers,
+                                 hits, &scores, context);
     }
 
     // Extract features
     float* features = NULL;
     int numberOfInstances = 0;
     if(numberOfFeatures > 0) {
-      int f;
-      features = malloc(hits * totalFeatures * sizeof(float));
-      FixedBuffer** buffer = malloc(qlen * sizeof(FixedBuffer*));
-      int** positions = malloc(qlen * sizeof(int*));
-      for(f = 0; f < qlen; f++) {
-        buffer[f] = createFixedBuffer(10);
-      }
-
-      for(i = 0; i < hits && set[i] > 0; i++) {
-        // Generate positions for query terms
-        getPositionsAsBuffers(index->vectors, set[i],
-                              index->pointers->docLen->counter[set[i]],
-                              queries[qindex], qlen, buffer);
-        for(f = 0; f < qlen; f++) {
-          positions[f] = buffer[f]->buffer;
-        }
-        // Compute feature values using the positions
-        for(f = 0; f < numberOfFeatures; f++) {
-          features[i * totalFeatures + f] =
-            extractors[f](positions, queries[qindex],
-                          qlen, set[i], index->pointers, &scorers[f]);
-        }
-        // Extract static features
-        for(f = 0; f < numberOfStaticFeatures; f++) {
-          features[i * totalFeatures + numberOfFeatures + f] =
-            staticFeatures[f][set[i]];
-        }
-        numberOfInstances++;
-      }
-      // Free temporary memory
-      for(f = 0; f < qlen; f++) {
-        destroyFixedBuffer(buffer[f]);
-      }
-      free(buffer);
-      free(positions);
+      // Rounded up to a multiple of V, as the tree evaluation below reads V instances at a time
+      features = (float*) allocateQueryContext(context, ((hits + V - 1) / V) * V *
+                                               totalFeatures * sizeof(float));
+      numberOfInstances = extractFeatures(featureExtractor, (int*) queries[qindex], qlen,
+                                          set, hits, features, context);
     }
 
     // If a tree model (LambdaMART) is provided, rank the instances
-    if(treeModel) {
+    if(quickScorer) {
+      scoreQuickScorer(quickScorer, features, totalFeatures, numberOfInstances, scores);
+    } else if(compiledModel) {
+      scoreCompiledModel(compiledModel, features, totalFeatures, numberOfInstances, scores);
+    } else if(cascade) {
+      numberOfInstances = scoreCascade(cascade, treeModel, features, totalFeatures,
+                                       numberOfInstances, set, scores);
+    } else if(treeModel) {
       if(numberOfInstances % V != 0) {
         numberOfInstances = ((numberOfInstances/V) + 1) * V;
       }
@@ -378,7 +502,9 @@ int main (int argc, char** args) {
 
     // Rank documents using relevance scores
     if(treeModel || (!treeModel && !features &&
-                     (algorithm == BWAND_OR || algorithm == WAND))) {
+                     (algorithm == BWAND_OR || algorithm == WAND ||
+                      algorithm == MAXSCORE || algorithm == RANKED_AND ||
+                      algorithm == BOOLEAN))) {
       clearHeap(rankedList);
       for(i = 0; i < hits && set[i] > 0; i++) {
         insertHeap(rankedList, set[i], scores[i]);
@@ -394,7 +520,9 @@ int main (int argc, char** args) {
     // If output is specified, write the retrieved set to output
     if(outputPath) {
       for(i = 0; i < hits && set[i] > 0; i++) {
-        if(!features && !treeModel && (algorithm != WAND && algorithm != BWAND_OR)) {
+        if(!features && !treeModel && (algorithm != WAND && algorithm != BWAND_OR &&
+                                       algorithm != MAXSCORE && algorithm != RANKED_AND &&
+                                       algorithm != BOOLEAN)) {
           if(!docnoMapping) {
             fprintf(fp, "%d %d ", id, set[i]);
           } else {
@@ -423,13 +551,6 @@ int main (int argc, char** args) {
       }
     }
 
-    // Free the allocated memory
-    if(features) free(features);
-    free(set);
-    free(qdf);
-    free(sortedDfIndex);
-    free(qHeadPointers);
-
     gettimeofday(&end, NULL);
     printf("%10.0f length: %d\n",
            ((float) ((end.tv_sec * 1000000 + end.tv_usec) -
@@ -452,11 +573,19 @@ int main (int argc, char** args) {
     }
     free(extractors);
     free(scorers);
+    destroyWindowCounts(windowCounts);
+    destroyFeatureExtractor(featureExtractor);
   }
   for(i = 0; i < totalQueries; i++) {
     if(queries[i]) {
       free(queries[i]);
     }
+    if(queryTrees && queryTrees[i]) {
+      destroyQueryNode(queryTrees[i]);
+    }
+  }
+  if(queryTrees) {
+    free(queryTrees);
   }
   if(docnoMapping) {
     int documentId;
@@ -465,7 +594,11 @@ int main (int argc, char** args) {
     }
     free(docnoMapping);
   }
+  if(quickScorer) destroyQuickScorer(quickScorer);
+  if(compiledModel) destroyCompiledModel(compiledModel);
+  if(cascade) destroyCascade(cascade);
   if(treeModel) destroyTreeModel(treeModel);
+  destroyQueryContext(context);
   if(scores) free(scores);
   free(queries);
   destroyHeap(rankedList);
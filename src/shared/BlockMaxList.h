@@ -0,0 +1,135 @@
+/**
+ * Block-max list of a postings list: for every segment of the chain,
+ * in traversal order, a pointer to the segment, its last docid, and
+ * the highest BM25 score that any of its postings contributes.
+ *
+ * Block maxima are not stored in the index. They depend on collection
+ * statistics, and are computed once the index has been read (see
+ * buildBlockMaxLists), from the term frequencies and document lengths.
+ * Since the list covers every segment, it also serves to gallop over
+ * the chain without following links.
+ */
+
+#ifndef BLOCK_MAX_LIST_H_GUARD
+#define BLOCK_MAX_LIST_H_GUARD
+
+#include <stdlib.h>
+#include "SegmentPool.h"
+#include "scorer/BM25.h"
+
+typedef struct BlockMaxList BlockMaxList;
+
+struct BlockMaxList {
+  // Number of segments
+  int length;
+  // Pointer to each segment
+  long* pointers;
+  // Last docid (in traversal order) of each segment
+  unsigned int* maxDocId;
+  // Highest BM25 score in each segment
+  float* maxScore;
+  // Highest BM25 score in segments i, i + 1, ..., length - 1
+  float* remainingMaxScore;
+};
+
+/**
+ * Builds the block-max list of the chain that starts at "headPointer."
+ * The postings list must contain term frequencies.
+ *
+ * @param pool Segment pool
+ * @param headPointer Head pointer of the postings list
+ * @param df Document frequency of the term
+ * @param docLen Document lengths
+ * @param totalDocs Number of documents in the collection
+ * @param avgDocLen Average document length
+ */
+BlockMaxList* createBlockMaxList(SegmentPool* pool, long headPointer, int df,
+                                 int* docLen, int totalDocs, float avgDocLen) {
+  BlockMaxList* list = (BlockMaxList*) malloc(sizeof(BlockMaxList));
+  int segments = 0;
+  long pointer = headPointer;
+  while(pointer != UNDEFINED_POINTER) {
+    segments++;
+    pointer = nextPointer(pool, pointer);
+  }
+
+  list->length = segments;
+  list->pointers = (long*) malloc(segments * sizeof(long));
+  list->maxDocId = (unsigned int*) malloc(segments * sizeof(unsigned int));
+  list->maxScore = (float*) malloc(segments * sizeof(float));
+  list->remainingMaxScore = (float*) malloc(segments * sizeof(float));
+
+  unsigned int* docid = (unsigned int*) calloc(BLOCK_SIZE * 2, sizeof(unsigned int));
+  unsigned int* tf = (unsigned int*) calloc(BLOCK_SIZE * 2, sizeof(unsigned int));
+  int i, j;
+  pointer = headPointer;
+  for(i = 0; i < segments; i++) {
+    int count = decompressDocidBlock(pool, docid, pointer);
+    decompressTfBlock(pool, tf, pointer);
+    float max = _default_bm25(tf[0], df, totalDocs, docLen[docid[0]], avgDocLen);
+    for(j = 1; j < count; j++) {
+      float score = _default_bm25(tf[j], df, totalDocs, docLen[docid[j]], avgDocLen);
+      if(score > max) {
+        max = score;
+      }
+    }
+    list->pointers[i] = pointer;
+    list->maxDocId[i] = getMaxDocId(pool, pointer);
+    list->maxScore[i] = max;
+    pointer = nextPointer(pool, pointer);
+  }
+  free(docid);
+  free(tf);
+
+  for(i = segments - 1; i >= 0; i--) {
+    list->remainingMaxScore[i] = list->maxScore[i];
+    if(i < segments - 1 && list->remainingMaxScore[i + 1] > list->maxScore[i]) {
+      list->remainingMaxScore[i] = list->remainingMaxScore[i + 1];
+    }
+  }
+  return list;
+}
+
+void destroyBlockMaxList(BlockMaxList* list) {
+  free(list->pointers);
+  free(list->maxDocId);
+  free(list->maxScore);
+  free(list->remainingMaxScore);
+  free(list);
+}
+
+/**
+ * Returns the first segment, starting from segment "from," whose last
+ * docid is not less than "docid," or the length of the list if the
+ * chain ends before it. Gallops over the segments, then binary searches
+ * the last hop.
+ *
+ * @param list Block-max list
+ * @param from Index of the current segment
+ * @param docid Target document id
+ * @param reverse Whether docids are in decreasing order
+ */
+int seekBlockMaxList(BlockMaxList* list, int from, unsigned int docid, int reverse) {
+  if(from >= list->length || !LESS_THAN(list->maxDocId[from], docid, reverse)) {
+    return from;
+  }
+  int hop = 1;
+  while(from + hop < list->length &&
+        LESS_THAN(list->maxDocId[from + hop], docid, reverse)) {
+    from += hop;
+    hop *= 2;
+  }
+  int low = from + 1;
+  int high = from + hop < list->length ? from + hop : list->length;
+  while(low < high) {
+    int middle = (low + high) >> 1;
+    if(LESS_THAN(list->maxDocId[middle], docid, reverse)) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+#endif
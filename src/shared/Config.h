@@ -19,6 +19,9 @@
 // Document vectors file name
 #define DOCUMENT_VECTOR_FILE "vectors"
 
+// Forward index file name
+#define FORWARD_INDEX_FILE "forward"
+
 // Number of pools in segment pool
 #define NUMBER_OF_POOLS 4
 
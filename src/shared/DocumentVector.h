@@ -7,66 +7,143 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "Config.h"
 #include "buffer/FixedBuffer.h"
+#include "QueryContext.h"
 #include "pfordelta/opt_p4.h"
 
+#define DOCUMENT_VECTOR_MAGIC 0x44564543
+
 typedef struct DocumentVector DocumentVector;
 
-// An expandable table that contains a PFOR compressed
-// document vector per document id
+// A table that contains a PFOR compressed document vector per document
+// id. Vectors are stored back to back in a single array, so that the
+// whole table is written sequentially, and can be loaded with mmap.
 struct DocumentVector {
   // Compressed document vectors
-  unsigned int** document;
-  // Length of vectors
+  unsigned int* data;
+  // Number of integers used, and allocated, in "data"
+  unsigned long size;
+  unsigned long dataCapacity;
+  // Offset of the vector of each document within "data"
+  unsigned long* offsets;
+  // Length of vectors (0 if there is no vector for the document)
   unsigned int* length;
-  // Capacity of the array
+  // Capacity of the table (max number of rows)
   unsigned int capacity;
+  // If the table was read from a file, the memory that holds all of
+  // the above, and whether it is mapped (or allocated). A table that
+  // was read from a file cannot be modified.
+  void* mapping;
+  size_t mappingSize;
+  int mapped;
 };
 
 /**
- * Write a Document Vectors index to output file.
+ * Returns the compressed vector of a document: the number of blocks,
+ * followed by each block, preceded by its size.
+ */
+unsigned int* getCompressedDocumentVector(DocumentVector* vectors, int docid) {
+  return &vectors->data[vectors->offsets[docid]];
+}
+
+/**
+ * Write a Document Vectors index to output file. The file consists of
+ * a header (magic number, number of rows, and total size of the
+ * vectors), the offset and length of every row, and all vectors back
+ * to back.
  *
  * @param vectors Document vectors index
  * @param fp Output binary file
  */
 void writeDocumentVector(DocumentVector* vectors, FILE* fp) {
-  fwrite(&vectors->capacity, sizeof(unsigned int), 1, fp);
-  int i;
-  for(i = 0; i < vectors->capacity; i++) {
-    if(vectors->document[i]) {
-      fwrite(&i, sizeof(int), 1, fp);
-      fwrite(&vectors->length[i], sizeof(int), 1, fp);
-      fwrite(vectors->document[i], sizeof(int), vectors->length[i], fp);
-    }
+  // Rows after the last document that has a vector are left out
+  unsigned int rows = vectors->capacity;
+  while(rows > 0 && vectors->length[rows - 1] == 0) {
+    rows--;
   }
-  i = -1;
-  fwrite(&i, sizeof(int), 1, fp);
+  unsigned int magic = DOCUMENT_VECTOR_MAGIC;
+  fwrite(&magic, sizeof(unsigned int), 1, fp);
+  fwrite(&rows, sizeof(unsigned int), 1, fp);
+  fwrite(&vectors->size, sizeof(unsigned long), 1, fp);
+  fwrite(vectors->offsets, sizeof(unsigned long), rows, fp);
+  fwrite(vectors->length, sizeof(unsigned int), rows, fp);
+  fwrite(vectors->data, sizeof(unsigned int), vectors->size, fp);
 }
 
 /**
- * Read a Document Vectors index from input file.
- *
- * @param fp Input binary file
- * @return Document vectors index
+ * Read a Document Vectors index in the former format, with one record
+ * (docid, length, vector) per document, into a contiguous table.
  */
-DocumentVector* readDocumentVector(FILE* fp) {
-  DocumentVector* vectors = (DocumentVector*) malloc(sizeof(DocumentVector));
+DocumentVector* readLegacyDocumentVector(FILE* fp) {
+  DocumentVector* vectors = (DocumentVector*) calloc(1, sizeof(DocumentVector));
   fread(&vectors->capacity, sizeof(unsigned int), 1, fp);
-  vectors->document = (unsigned int**) calloc(vectors->capacity, sizeof(unsigned int*));
+  vectors->offsets = (unsigned long*) calloc(vectors->capacity, sizeof(unsigned long));
   vectors->length = (unsigned int*) calloc(vectors->capacity, sizeof(unsigned int));
+  vectors->dataCapacity = vectors->capacity;
+  vectors->data = (unsigned int*) malloc(vectors->dataCapacity * sizeof(unsigned int));
 
   int i;
   fread(&i, sizeof(int), 1, fp);
   while(i >= 0) {
     fread(&vectors->length[i], sizeof(unsigned int), 1, fp);
-    vectors->document[i] = (unsigned int*) calloc(vectors->length[i], sizeof(unsigned int));
-    fread(vectors->document[i], sizeof(unsigned int), vectors->length[i], fp);
+    while(vectors->size + vectors->length[i] > vectors->dataCapacity) {
+      vectors->dataCapacity *= 2;
+      vectors->data = (unsigned int*)
+        realloc(vectors->data, vectors->dataCapacity * sizeof(unsigned int));
+    }
+    vectors->offsets[i] = vectors->size;
+    fread(&vectors->data[vectors->size], sizeof(unsigned int), vectors->length[i], fp);
+    vectors->size += vectors->length[i];
     fread(&i, sizeof(int), 1, fp);
   }
   return vectors;
 }
 
+/**
+ * Read a Document Vectors index from input file. The file is mapped
+ * into memory rather than read, so that loading does not depend on the
+ * number of documents. If it cannot be mapped, it is read at once.
+ * Files in the former format are converted while being read.
+ *
+ * @param fp Input binary file, at its beginning
+ * @return Document vectors index
+ */
+DocumentVector* readDocumentVector(FILE* fp) {
+  unsigned int magic = 0;
+  fread(&magic, sizeof(unsigned int), 1, fp);
+  if(magic != DOCUMENT_VECTOR_MAGIC) {
+    rewind(fp);
+    return readLegacyDocumentVector(fp);
+  }
+
+  DocumentVector* vectors = (DocumentVector*) calloc(1, sizeof(DocumentVector));
+  struct stat status;
+  fstat(fileno(fp), &status);
+  vectors->mappingSize = status.st_size;
+  vectors->mapping = mmap(NULL, vectors->mappingSize, PROT_READ, MAP_PRIVATE,
+                          fileno(fp), 0);
+  vectors->mapped = 1;
+  if(vectors->mapping == MAP_FAILED) {
+    rewind(fp);
+    vectors->mapping = malloc(vectors->mappingSize);
+    fread(vectors->mapping, 1, vectors->mappingSize, fp);
+    vectors->mapped = 0;
+  }
+
+  char* header = (char*) vectors->mapping;
+  vectors->capacity = *(unsigned int*) &header[sizeof(unsigned int)];
+  vectors->size = *(unsigned long*) &header[2 * sizeof(unsigned int)];
+  vectors->dataCapacity = vectors->size;
+  vectors->offsets = (unsigned long*) &header[2 * sizeof(unsigned int) + sizeof(unsigned long)];
+  vectors->length = (unsigned int*) &vectors->offsets[vectors->capacity];
+  vectors->data = &vectors->length[vectors->capacity];
+  return vectors;
+}
+
 /**
  * Creates a new document vectors index.
  *
@@ -74,12 +151,12 @@ DocumentVector* readDocumentVector(FILE* fp) {
  * @return A document vectors index
  */
 DocumentVector* createDocumentVector(unsigned int initialSize) {
-  DocumentVector* vectors = (DocumentVector*)
-    malloc(sizeof(DocumentVector));
+  DocumentVector* vectors = (DocumentVector*) calloc(1, sizeof(DocumentVector));
   vectors->capacity = initialSize;
+  vectors->offsets = (unsigned long*) calloc(initialSize, sizeof(unsigned long));
   vectors->length = (unsigned int*) calloc(initialSize, sizeof(unsigned int));
-  vectors->document = (unsigned int**) calloc(initialSize, sizeof(unsigned int*));
-  int i;
+  vectors->dataCapacity = initialSize;
+  vectors->data = (unsigned int*) malloc(vectors->dataCapacity * sizeof(unsigned int));
   return vectors;
 }
 
@@ -87,14 +164,17 @@ DocumentVector* createDocumentVector(unsigned int initialSize) {
  * Free used memory
  */
 void destroyDocumentVector(DocumentVector* vectors) {
-  int i;
-  for(i = 0; i < vectors->capacity; i++) {
-    if(vectors->document[i]) {
-      free(vectors->document[i]);
+  if(vectors->mapping) {
+    if(vectors->mapped) {
+      munmap(vectors->mapping, vectors->mappingSize);
+    } else {
+      free(vectors->mapping);
     }
+  } else {
+    free(vectors->data);
+    free(vectors->offsets);
+    free(vectors->length);
   }
-  free(vectors->document);
-  free(vectors->length);
   free(vectors);
 }
 
@@ -102,17 +182,12 @@ void destroyDocumentVector(DocumentVector* vectors) {
  * Expand table by a factor of 2.
  */
 void expandDocumentVector(DocumentVector* vectors) {
-  unsigned int** tempDocument = (unsigned int**) realloc(vectors->document,
-      vectors->capacity * 2 * sizeof(unsigned int*));
-  unsigned int* tempLength = (unsigned int*) realloc(vectors->length,
+  vectors->offsets = (unsigned long*) realloc(vectors->offsets,
+      vectors->capacity * 2 * sizeof(unsigned long));
+  vectors->length = (unsigned int*) realloc(vectors->length,
       vectors->capacity * 2 * sizeof(unsigned int));
-  int i;
-  for(i = vectors->capacity; i < vectors->capacity * 2; i++) {
-    tempDocument[i] = NULL;
-    tempLength[i] = 0;
-  }
-  vectors->document = tempDocument;
-  vectors->length = tempLength;
+  memset(&vectors->offsets[vectors->capacity], 0, vectors->capacity * sizeof(unsigned long));
+  memset(&vectors->length[vectors->capacity], 0, vectors->capacity * sizeof(unsigned int));
   vectors->capacity *= 2;
 }
 
@@ -120,7 +195,7 @@ void expandDocumentVector(DocumentVector* vectors) {
  * Whether or not a document vector is stored for the given document id
  */
 int containsDocumentVector(DocumentVector* vectors, int docid) {
-  return vectors->document[docid] != NULL;
+  return docid < vectors->capacity && vectors->length[docid] != 0;
 }
 
 /**
@@ -132,16 +207,17 @@ int containsDocumentVector(DocumentVector* vectors, int docid) {
  * @param k Document id
  */
 void getDocumentVector(DocumentVector* vectors, unsigned int* document, int length, int k) {
-  if(k >= vectors->capacity || !vectors->document[k]) {
+  if(!containsDocumentVector(vectors, k)) {
     document = NULL;
     return;
   }
   unsigned int aux[BLOCK_SIZE * 4];
-  int nb = vectors->document[k][0], i, pos = 1;
+  unsigned int* vector = getCompressedDocumentVector(vectors, k);
+  int nb = vector[0], i, pos = 1;
   unsigned int* buffer = (unsigned int*) calloc(nb * BLOCK_SIZE, sizeof(unsigned int));
   for(i = 0; i < nb; i++) {
-    detailed_p4_decode(&buffer[i * BLOCK_SIZE], &vectors->document[k][pos + 1], aux, 0, 0);
-    pos += vectors->document[k][pos] + 1;
+    detailed_p4_decode(&buffer[i * BLOCK_SIZE], &vector[pos + 1], aux, 0, 0);
+    pos += vector[pos] + 1;
     memset(aux, 0, BLOCK_SIZE * 4 * sizeof(unsigned int));
   }
   memcpy(document, buffer, length * sizeof(unsigned int));
@@ -184,33 +260,128 @@ int** getPositions(DocumentVector* vectors, int docid, int docLength, int* query
   return positions;
 }
 
+/**
+ * Maps the term ids of a query to their indexes in the query, so that
+ * every token of a document vector is looked up with a single probe,
+ * instead of being compared against each query term.
+ */
+typedef struct QueryTermTable QueryTermTable;
+
+struct QueryTermTable {
+  // Open addressing table of term ids (-1 if the slot is empty), and
+  // the index in the query of the first occurrence of each term
+  int* termid;
+  int* first;
+  unsigned int mask;
+  // Index of the next occurrence of the same term in the query, or -1
+  int* next;
+};
+
+/**
+ * Builds the lookup table of a query. The table is drawn from "context"
+ * and can be shared, read-only, by several threads.
+ */
+QueryTermTable* createQueryTermTable(int* query, int qlength, QueryContext* context) {
+  QueryTermTable* table = (QueryTermTable*)
+    allocateQueryContext(context, sizeof(QueryTermTable));
+  unsigned int size = 8;
+  while(size < qlength * 4) {
+    size *= 2;
+  }
+  table->mask = size - 1;
+  table->termid = (int*) allocateQueryContext(context, size * sizeof(int));
+  table->first = (int*) allocateQueryContext(context, size * sizeof(int));
+  table->next = (int*) allocateQueryContext(context, qlength * sizeof(int));
+  memset(table->termid, -1, size * sizeof(int));
+
+  int q;
+  for(q = qlength - 1; q >= 0; q--) {
+    unsigned int slot = ((unsigned int) query[q] * 2654435761u) & table->mask;
+    while(table->termid[slot] != -1 && table->termid[slot] != query[q]) {
+      slot = (slot + 1) & table->mask;
+    }
+    table->next[q] = table->termid[slot] == query[q] ? table->first[slot] : -1;
+    table->termid[slot] = query[q];
+    table->first[slot] = q;
+  }
+  return table;
+}
+
+/**
+ * Returns the index of the first occurrence of "termid" in the query,
+ * or -1 if it is not a query term.
+ */
+int findQueryTermTable(QueryTermTable* table, int termid) {
+  unsigned int slot = ((unsigned int) termid * 2654435761u) & table->mask;
+  while(table->termid[slot] != -1) {
+    if(table->termid[slot] == termid) {
+      return table->first[slot];
+    }
+    slot = (slot + 1) & table->mask;
+  }
+  return -1;
+}
+
+/**
+ * Decompresses a document vector and collects the positions of the
+ * query terms. buffers[q]->buffer[0] is the number of positions of
+ * term q, followed by the positions themselves.
+ *
+ * @param vectors Document vectors index
+ * @param docid Document id
+ * @param docLength Document length
+ * @param table Lookup table of the query terms
+ * @param qlength Number of query terms
+ * @param buffers Output buffers, one per query term
+ * @param block Decoding buffer of BLOCK_SIZE * 2 integers
+ * @param aux Decoding buffer of BLOCK_SIZE * 4 integers
+ */
 void getPositionsAsBuffers(DocumentVector* vectors, int docid, int docLength,
-                           int* query, int qlength, FixedBuffer** buffers) {
+                           QueryTermTable* table, int qlength, FixedBuffer** buffers,
+                           unsigned int* block, unsigned int* aux) {
   int q, t, i, pos = 1;
   for(q = 0; q < qlength; q++) resetFixedBuffer(buffers[q]);
 
-  int nb = vectors->document[docid][0], index = 1;
-  unsigned int* aux = calloc(BLOCK_SIZE * 4, sizeof(unsigned int));
-  unsigned int* buffer = (unsigned int*) calloc(BLOCK_SIZE, sizeof(unsigned int));
-
+  unsigned int* vector = getCompressedDocumentVector(vectors, docid);
+  int nb = vector[0], index = 1;
   for(i = 0; i < nb; i++) {
-    detailed_p4_decode(buffer, &vectors->document[docid][index + 1], aux, 0, 0);
+    detailed_p4_decode(block, &vector[index + 1], aux, 0, 0);
 
     for(t = 0; t < BLOCK_SIZE && pos <= docLength; t++) {
-      for(q = 0; q < qlength; q++) {
-        if(buffer[t] == query[q]) {
-          setFixedBuffer(buffers[q], buffers[q]->buffer[0] + 1, pos);
-          buffers[q]->buffer[0]++;
-        }
+      for(q = findQueryTermTable(table, block[t]); q >= 0; q = table->next[q]) {
+        setFixedBuffer(buffers[q], buffers[q]->buffer[0] + 1, pos);
+        buffers[q]->buffer[0]++;
       }
       pos++;
     }
 
-    index += vectors->document[docid][index] + 1;
-    memset(aux, 0, BLOCK_SIZE * 4 * sizeof(unsigned int));
+    index += vector[index] + 1;
   }
-  free(buffer);
-  free(aux);
+}
+
+/**
+ * Appends an already compressed record to the table, as the vector of
+ * document k. The record is copied.
+ *
+ * @param vectors Document vectors index
+ * @param vector Compressed record
+ * @param csize Length of the record
+ * @param k Document id
+ */
+void appendDocumentVector(DocumentVector* vectors, unsigned int* vector,
+                          unsigned int csize, int k) {
+  while(k >= vectors->capacity) {
+    expandDocumentVector(vectors);
+  }
+  while(vectors->size + csize > vectors->dataCapacity) {
+    vectors->dataCapacity *= 2;
+    vectors->data = (unsigned int*)
+      realloc(vectors->data, vectors->dataCapacity * sizeof(unsigned int));
+  }
+  memcpy(&vectors->data[vectors->size], vector, csize * sizeof(unsigned int));
+  vectors->offsets[k] = vectors->size;
+  vectors->length[k] = csize;
+  vectors->size += csize;
 }
 
 /**
@@ -223,10 +394,6 @@ void getPositionsAsBuffers(DocumentVector* vectors, int docid, int docLength,
  */
 void addDocumentVector(DocumentVector* vectors, unsigned int* document,
                        unsigned int length, int k) {
-  if(k >= vectors->capacity) {
-    expandDocumentVector(vectors);
-  }
-
   int nb = length / BLOCK_SIZE;
   int res = length % BLOCK_SIZE;
   unsigned int* block = (unsigned int*) calloc((nb + 1) * BLOCK_SIZE * 2, sizeof(unsigned int));
@@ -246,12 +413,8 @@ void addDocumentVector(DocumentVector* vectors, unsigned int* document,
     free(a);
     i++;
   }
-  vectors->length[k] = csize;
-  vectors->document[k] = (unsigned int*) calloc(csize, sizeof(unsigned int));
-  vectors->document[k][0] = i;
-  for(i = 1; i < csize; i++) {
-    vectors->document[k][i] = block[i];
-  }
+  block[0] = i;
+  appendDocumentVector(vectors, block, csize, k);
   free(block);
 }
 
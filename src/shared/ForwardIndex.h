@@ -0,0 +1,188 @@
+/**
+ * Forward index: for every document, the sorted list of its distinct
+ * term ids, and the frequency (tf) of each. Features that only need
+ * the tf of query terms look them up here, instead of decoding and
+ * scanning a whole document vector.
+ *
+ * The record of a document holds term ids (delta-encoded) and tfs in
+ * separate PFOR blocks of BLOCK_SIZE terms:
+ *
+ *   [number of terms][number of blocks nb][last term id of blocks 0..nb-1]
+ *   [size][term id block][size][tf block]
+ *   ...
+ *
+ * The last term id of each block tells which block a term falls into,
+ * so a lookup decodes at most one block of term ids and one of tfs.
+ * Records are stored in a document vectors table, and are written and
+ * loaded the same way as document vectors.
+ */
+
+#ifndef FORWARD_INDEX_H_GUARD
+#define FORWARD_INDEX_H_GUARD
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "DocumentVector.h"
+#include "pfordelta/opt_p4.h"
+
+typedef struct ForwardIndex ForwardIndex;
+
+struct ForwardIndex {
+  // Compressed record of each document
+  DocumentVector* records;
+};
+
+ForwardIndex* createForwardIndex(unsigned int initialSize) {
+  ForwardIndex* forward = (ForwardIndex*) malloc(sizeof(ForwardIndex));
+  forward->records = createDocumentVector(initialSize);
+  return forward;
+}
+
+void destroyForwardIndex(ForwardIndex* forward) {
+  destroyDocumentVector(forward->records);
+  free(forward);
+}
+
+void writeForwardIndex(ForwardIndex* forward, FILE* fp) {
+  writeDocumentVector(forward->records, fp);
+}
+
+ForwardIndex* readForwardIndex(FILE* fp) {
+  ForwardIndex* forward = (ForwardIndex*) malloc(sizeof(ForwardIndex));
+  forward->records = readDocumentVector(fp);
+  return forward;
+}
+
+/**
+ * Whether or not a record is stored for the given document id
+ */
+int containsForwardIndex(ForwardIndex* forward, int docid) {
+  return containsDocumentVector(forward->records, docid);
+}
+
+int compareTermIds(const void* a, const void* b) {
+  unsigned int x = *(const unsigned int*) a, y = *(const unsigned int*) b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Counts the terms of a document, then compresses and inserts its
+ * record into the index.
+ *
+ * @param forward Forward index
+ * @param document Term ids of the document, in document order
+ * @param length Document length
+ * @param k Document id
+ */
+void addForwardIndex(ForwardIndex* forward, unsigned int* document,
+                     unsigned int length, int k) {
+  unsigned int* terms = (unsigned int*) malloc((length + 1) * sizeof(unsigned int));
+  unsigned int* tf = (unsigned int*) malloc((length + 1) * sizeof(unsigned int));
+  memcpy(terms, document, length * sizeof(unsigned int));
+  qsort(terms, length, sizeof(unsigned int), compareTermIds);
+  int n = 0, i;
+  for(i = 0; i < length; i++) {
+    if(n > 0 && terms[n - 1] == terms[i]) {
+      tf[n - 1]++;
+    } else {
+      terms[n] = terms[i];
+      tf[n++] = 1;
+    }
+  }
+
+  int nb = (n + BLOCK_SIZE - 1) / BLOCK_SIZE, b;
+  unsigned int* record = (unsigned int*)
+    calloc(2 + nb + nb * 2 * (BLOCK_SIZE * 2 + 1), sizeof(unsigned int));
+  unsigned int* block = (unsigned int*) malloc(BLOCK_SIZE * sizeof(unsigned int));
+  record[0] = n;
+  record[1] = nb;
+  int csize = 2 + nb;
+  for(b = 0; b < nb; b++) {
+    int count = n - b * BLOCK_SIZE < BLOCK_SIZE ? n - b * BLOCK_SIZE : BLOCK_SIZE;
+    record[2 + b] = terms[b * BLOCK_SIZE + count - 1];
+
+    memset(block, 0, BLOCK_SIZE * sizeof(unsigned int));
+    memcpy(block, &terms[b * BLOCK_SIZE], count * sizeof(unsigned int));
+    record[csize] = OPT4(block, count, &record[csize + 1], 1);
+    csize += record[csize] + 1;
+
+    memset(block, 0, BLOCK_SIZE * sizeof(unsigned int));
+    memcpy(block, &tf[b * BLOCK_SIZE], count * sizeof(unsigned int));
+    record[csize] = OPT4(block, count, &record[csize + 1], 0);
+    csize += record[csize] + 1;
+  }
+  appendDocumentVector(forward->records, record, csize, k);
+
+  free(block);
+  free(record);
+  free(terms);
+  free(tf);
+}
+
+/**
+ * Looks up the term frequencies of the query terms in a document.
+ * Only the blocks that may contain a query term are decoded.
+ *
+ * @param forward Forward index
+ * @param docid Document id
+ * @param query Query terms
+ * @param qlength Number of query terms
+ * @param tf Output term frequencies, one per query term (0 if the term
+ *        does not occur in the document)
+ * @param block Decoding buffer of BLOCK_SIZE * 4 integers
+ * @param aux Decoding buffer of BLOCK_SIZE * 4 integers
+ */
+void getTermFrequencies(ForwardIndex* forward, int docid, int* query, int qlength,
+                        int* tf, unsigned int* block, unsigned int* aux) {
+  int q;
+  for(q = 0; q < qlength; q++) {
+    tf[q] = 0;
+  }
+  if(!containsForwardIndex(forward, docid)) {
+    return;
+  }
+
+  unsigned int* record = getCompressedDocumentVector(forward->records, docid);
+  int n = record[0], nb = record[1], b;
+  unsigned int* last = &record[2];
+  unsigned int* termids = block;
+  unsigned int* tfs = &block[BLOCK_SIZE * 2];
+  unsigned int* p = &record[2 + nb];
+  for(b = 0; b < nb; b++) {
+    unsigned int first = b == 0 ? 0 : last[b - 1] + 1;
+    int count = n - b * BLOCK_SIZE < BLOCK_SIZE ? n - b * BLOCK_SIZE : BLOCK_SIZE;
+    int decoded = 0, tfDecoded = 0;
+    for(q = 0; q < qlength; q++) {
+      unsigned int termid = query[q];
+      if(termid < first || termid > last[b]) {
+        continue;
+      }
+      if(!decoded) {
+        detailed_p4_decode(termids, &p[1], aux, 1, 0);
+        decoded = 1;
+      }
+      // Binary search for the term within the block
+      int low = 0, high = count - 1;
+      while(low < high) {
+        int mid = (low + high) / 2;
+        if(termids[mid] < termid) {
+          low = mid + 1;
+        } else {
+          high = mid;
+        }
+      }
+      if(termids[low] == termid) {
+        if(!tfDecoded) {
+          detailed_p4_decode(tfs, &p[p[0] + 2], aux, 0, 0);
+          tfDecoded = 1;
+        }
+        tf[q] = tfs[low];
+      }
+    }
+    p += p[0] + 1;
+    p += p[0] + 1;
+  }
+}
+
+#endif
@@ -8,6 +8,11 @@
  *    etc.
  *  - DocumentVectors, which contains compressed document vector representation
  *    of documents
+ *  - ForwardIndex, which contains the term frequencies of every document
+ *  - SkipLists, which speed up lookups in Bloom filter chains. They are
+ *    not stored, but built when the index is read.
+ *  - BlockMaxLists, which hold per-segment BM25 upper bounds. They are
+ *    not stored either, and are only built on request.
  *
  * @author Nima Asadi
  */
@@ -25,6 +30,8 @@
 #include "SegmentPool.h"
 #include "Pointers.h"
 #include "DocumentVector.h"
+#include "ForwardIndex.h"
+#include "BlockMaxList.h"
 #include "Config.h"
 
 typedef struct InvertedIndex InvertedIndex;
@@ -34,9 +41,17 @@ struct InvertedIndex {
   Dictionary** dictionary;
   Pointers* pointers;
   DocumentVector* vectors;
+  // Term frequencies of each document (only if built at indexing time)
+  ForwardIndex* forward;
+  // Skip list of each term (only if Bloom filter chains are present)
+  SkipList** skipLists;
+  unsigned int numberOfSkipLists;
+  // Block-max list of each term (only if built with buildBlockMaxLists)
+  BlockMaxList** blockMaxLists;
+  unsigned int numberOfBlockMaxLists;
 };
 
-InvertedIndex* createInvertedIndex(int reverse, int indexVectors,
+InvertedIndex* createInvertedIndex(int reverse, int indexVectors, int indexForward,
                                    int bloomEnabled, unsigned int nbHash,
                                    unsigned int bitsPerElement) {
   InvertedIndex* index = (InvertedIndex*) malloc(sizeof(InvertedIndex));
@@ -45,9 +60,17 @@ InvertedIndex* createInvertedIndex(int reverse, int indexVectors,
   index->dictionary = initDictionary();
   index->pointers = createPointers(DEFAULT_VOCAB_SIZE);
   index->vectors = NULL;
+  index->forward = NULL;
+  index->skipLists = NULL;
+  index->numberOfSkipLists = 0;
+  index->blockMaxLists = NULL;
+  index->numberOfBlockMaxLists = 0;
   if(indexVectors) {
     index->vectors = createDocumentVector(DEFAULT_COLLECTION_SIZE);
   }
+  if(indexForward) {
+    index->forward = createForwardIndex(DEFAULT_COLLECTION_SIZE);
+  }
   return index;
 }
 
@@ -55,6 +78,10 @@ int indexDocumentVectors(InvertedIndex* index) {
   return index->vectors != NULL;
 }
 
+int indexForwardIndex(InvertedIndex* index) {
+  return index->forward != NULL;
+}
+
 int hasValidPostingsList(InvertedIndex* index, int termid) {
   return getHeadPointer(index->pointers, termid) != UNDEFINED_POINTER;
 }
@@ -76,13 +103,94 @@ int getDf_InvertedIndex(InvertedIndex* index, int term) {
   return getFixedIntCounter(index->pointers->df, term);
 }
 
+/**
+ * Returns the skip list of a term, or NULL if the index has no
+ * Bloom filter chains.
+ */
+SkipList* getSkipList(InvertedIndex* index, int term) {
+  if(term < 0 || term >= index->numberOfSkipLists) {
+    return NULL;
+  }
+  return index->skipLists[term];
+}
+
+/**
+ * Builds a skip list for the Bloom filter chain of every term.
+ */
+void buildSkipLists(InvertedIndex* index) {
+  int term = -1;
+  index->numberOfSkipLists = 0;
+  while((term = nextTermId(index, term)) != -1) {
+    index->numberOfSkipLists = term + 1;
+  }
+  index->skipLists = (SkipList**) calloc(index->numberOfSkipLists, sizeof(SkipList*));
+  while((term = nextTermId(index, term)) != -1) {
+    index->skipLists[term] = createSkipList(index->pool,
+                                            getHeadPointer(index->pointers, term));
+  }
+}
+
+/**
+ * Returns the block-max list of a term, or NULL if block-max lists
+ * have not been built.
+ */
+BlockMaxList* getBlockMaxList(InvertedIndex* index, int term) {
+  if(term < 0 || term >= index->numberOfBlockMaxLists) {
+    return NULL;
+  }
+  return index->blockMaxLists[term];
+}
+
+/**
+ * Builds the block-max list of every term. This takes a pass over all
+ * docid and tf blocks, and requires an index with term frequencies.
+ */
+void buildBlockMaxLists(InvertedIndex* index) {
+  float avgDocLen = index->pointers->totalDocLen / (float) index->pointers->totalDocs;
+  int term = -1;
+  index->numberOfBlockMaxLists = 0;
+  while((term = nextTermId(index, term)) != -1) {
+    index->numberOfBlockMaxLists = term + 1;
+  }
+  index->blockMaxLists = (BlockMaxList**) calloc(index->numberOfBlockMaxLists,
+                                                 sizeof(BlockMaxList*));
+  while((term = nextTermId(index, term)) != -1) {
+    index->blockMaxLists[term] =
+      createBlockMaxList(index->pool, getHeadPointer(index->pointers, term),
+                         getDf(index->pointers, term),
+                         index->pointers->docLen->counter,
+                         index->pointers->totalDocs, avgDocLen);
+  }
+}
+
 void destroyInvertedIndex(InvertedIndex* index) {
+  if(index->blockMaxLists) {
+    int i;
+    for(i = 0; i < index->numberOfBlockMaxLists; i++) {
+      if(index->blockMaxLists[i]) {
+        destroyBlockMaxList(index->blockMaxLists[i]);
+      }
+    }
+    free(index->blockMaxLists);
+  }
+  if(index->skipLists) {
+    int i;
+    for(i = 0; i < index->numberOfSkipLists; i++) {
+      if(index->skipLists[i]) {
+        destroySkipList(index->skipLists[i]);
+      }
+    }
+    free(index->skipLists);
+  }
   destroySegmentPool(index->pool);
   destroyDictionary(index->dictionary);
   destroyPointers(index->pointers);
   if(index->vectors) {
     destroyDocumentVector(index->vectors);
   }
+  if(index->forward) {
+    destroyForwardIndex(index->forward);
+  }
 }
 
 InvertedIndex* readInvertedIndex(char* rootPath) {
@@ -124,6 +232,26 @@ InvertedIndex* readInvertedIndex(char* rootPath) {
     index->vectors = NULL;
   }
 
+  char forwardPath[1024];
+  strcpy(forwardPath, rootPath);
+  strcat(forwardPath, "/");
+  strcat(forwardPath, FORWARD_INDEX_FILE);
+  if(!access(forwardPath, F_OK)) {
+    fp = fopen(forwardPath, "rb");
+    index->forward = readForwardIndex(fp);
+    fclose(fp);
+  } else {
+    index->forward = NULL;
+  }
+
+  index->skipLists = NULL;
+  index->numberOfSkipLists = 0;
+  index->blockMaxLists = NULL;
+  index->numberOfBlockMaxLists = 0;
+  if(index->pool->bloomEnabled) {
+    buildSkipLists(index);
+  }
+
   return index;
 }
 
@@ -161,6 +289,16 @@ void writeInvertedIndex(InvertedIndex* index, char* rootPath) {
     writeDocumentVector(index->vectors, ofp);
     fclose(ofp);
   }
+
+  if(index->forward) {
+    char forwardPath[1024];
+    strcpy(forwardPath, rootPath);
+    strcat(forwardPath, "/");
+    strcat(forwardPath, FORWARD_INDEX_FILE);
+    ofp = fopen(forwardPath, "wb");
+    writeForwardIndex(index->forward, ofp);
+    fclose(ofp);
+  }
 }
 
 #endif
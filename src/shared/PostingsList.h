@@ -2,10 +2,14 @@
 #define POSTINGS_LIST_H_GUARD
 
 #include <stdio.h>
+#include <string.h>
 #include "InvertedIndex.h"
 #include "SegmentPool.h"
 #include "Pointers.h"
 #include "pfordelta/opt_p4.h"
+#include "intersection/SvS.h"
+#include "scorer/BM25.h"
+#include "QueryContext.h"
 
 typedef struct PostingsList PostingsList;
 
@@ -68,6 +72,31 @@ void nextPosting(PostingsList* list) {
   list->position++;
 }
 
+/**
+ * Moves the list to the first posting whose docid is not less than
+ * "docid." Blocks that end before "docid" are skipped using the docid
+ * stored in their header, without being decompressed.
+ *
+ * @return 0 if there is no such posting, 1 otherwise
+ */
+int skipTo(PostingsList* list, int docid) {
+  if(list->pointer == UNDEFINED_POINTER) {
+    return 0;
+  }
+  long pointer = list->pointer;
+  int index = list->position < 0 ? 0 : list->position;
+  if(!gallopSearch(list->index->pool, list->docid, &list->length,
+                   &index, &list->pointer, docid)) {
+    list->position = list->length;
+    return 0;
+  }
+  if(list->pointer != pointer && list->tf) {
+    decompressTfBlock(list->index->pool, list->tf, list->pointer);
+  }
+  list->position = index;
+  return 1;
+}
+
 int hasNext(PostingsList* list) {
   return (list->position < list->length - 1) ||
     (list->position == list->length - 1 &&
@@ -89,4 +118,270 @@ int getDocumentFrequency(PostingsList* list) {
   return list->df;
 }
 
+/**
+ * A Cursor walks over the postings list of a single query term, block
+ * by block. It is the building block for query algorithms: "next" and
+ * "nextGEQ" move it forward (the latter skipping whole blocks using the
+ * segment headers and searching the decoded block with SIMD compares),
+ * while term frequencies and positions are only decompressed once they
+ * are asked for within a block.
+ *
+ * Cursors are allocated from a QueryContext and are therefore only
+ * valid until the context is reset:
+ *
+ *   Cursor* cursor = createCursor(pool, headPointer, df, context);
+ *   while(isValidCursor(cursor)) {
+ *     float score = scoreCursor(cursor, docLen, totalDocs, avgDocLen);
+ *     ...
+ *     nextCursor(cursor);
+ *   }
+ */
+typedef struct Cursor Cursor;
+
+struct Cursor {
+  SegmentPool* pool;
+  QueryContext* context;
+  int df;
+
+  // Current block and position within it
+  long pointer;
+  unsigned int* docid;
+  int count;
+  int index;
+
+  // Term frequencies of the current block (decoded on demand)
+  unsigned int* tf;
+  int tfDecoded;
+
+  // Positions of the current block. Sub-blocks are decoded on demand,
+  // at most once each, with sub-block i landing at
+  // positions[i * BLOCK_SIZE]; those the cursor skips over are never
+  // decoded.
+  unsigned int* positions;
+  int positionsLength;
+  // Whether the state below has been set up for the current block
+  int positionsDecoded;
+  // Last decoded sub-block, and the offset of the next one in the pool
+  int positionsBlock;
+  unsigned int positionsHeader;
+  // Running offset of the first position of posting "positionsIndex"
+  int positionsIndex;
+  int positionsOffset;
+  // Last posting whose gaps have been turned into positions, in place
+  int positionsSpan;
+};
+
+/**
+ * Creates a cursor positioned at the first posting of a list.
+ *
+ * @param pool Segment pool
+ * @param headPointer Pointer to the first segment of the list
+ * @param df Document frequency of the term
+ * @param context Query context the cursor and its buffers come from
+ * @return A new cursor
+ */
+Cursor* createCursor(SegmentPool* pool, long headPointer, int df,
+                     QueryContext* context) {
+  Cursor* cursor = (Cursor*) allocateQueryContext(context, sizeof(Cursor));
+  cursor->pool = pool;
+  cursor->context = context;
+  cursor->df = df;
+  cursor->pointer = headPointer;
+  cursor->docid = (unsigned int*)
+    allocateQueryContext(context, BLOCK_SIZE * 2 * sizeof(unsigned int));
+  cursor->tf = NULL;
+  cursor->tfDecoded = 0;
+  cursor->positions = NULL;
+  cursor->positionsLength = 0;
+  cursor->positionsDecoded = 0;
+  cursor->index = 0;
+  cursor->count = 0;
+  if(headPointer != UNDEFINED_POINTER) {
+    cursor->count = decompressDocidBlock(pool, cursor->docid, headPointer);
+  }
+  return cursor;
+}
+
+/**
+ * Whether or not the cursor still points to a posting.
+ */
+int isValidCursor(Cursor* cursor) {
+  return cursor->pointer != UNDEFINED_POINTER;
+}
+
+unsigned int getDocidCursor(Cursor* cursor) {
+  return cursor->docid[cursor->index];
+}
+
+/**
+ * Moves the cursor to the next posting.
+ *
+ * @return 0 if the list has been exhausted, 1 otherwise
+ */
+int nextCursor(Cursor* cursor) {
+  if(cursor->pointer == UNDEFINED_POINTER) {
+    return 0;
+  }
+  cursor->index++;
+  if(cursor->index < cursor->count) {
+    return 1;
+  }
+  cursor->pointer = nextPointer(cursor->pool, cursor->pointer);
+  if(cursor->pointer == UNDEFINED_POINTER) {
+    return 0;
+  }
+  cursor->count = decompressDocidBlock(cursor->pool, cursor->docid, cursor->pointer);
+  cursor->index = 0;
+  cursor->tfDecoded = 0;
+  cursor->positionsDecoded = 0;
+  return 1;
+}
+
+/**
+ * Moves the cursor to the first posting whose docid is not less than
+ * "docid." The cursor never moves backwards.
+ *
+ * @return 0 if the list has been exhausted, 1 otherwise
+ */
+int nextGEQCursor(Cursor* cursor, unsigned int docid) {
+  if(cursor->pointer == UNDEFINED_POINTER) {
+    return 0;
+  }
+  long pointer = cursor->pointer;
+  if(!gallopSearch(cursor->pool, cursor->docid, &cursor->count,
+                   &cursor->index, &cursor->pointer, docid)) {
+    return 0;
+  }
+  if(cursor->pointer != pointer) {
+    cursor->tfDecoded = 0;
+    cursor->positionsDecoded = 0;
+  }
+  return 1;
+}
+
+/**
+ * Returns the term frequency of the current posting, decompressing
+ * the tf block on first use within a block.
+ */
+unsigned int getTfCursor(Cursor* cursor) {
+  if(!cursor->tfDecoded) {
+    if(!cursor->tf) {
+      cursor->tf = (unsigned int*)
+        allocateQueryContext(cursor->context, BLOCK_SIZE * 2 * sizeof(unsigned int));
+    }
+    decompressTfBlock(cursor->pool, cursor->tf, cursor->pointer);
+    cursor->tfDecoded = 1;
+  }
+  return cursor->tf[cursor->index];
+}
+
+/**
+ * Returns the positions of the current posting, in a span of the
+ * cursor's position cache that remains valid until the cursor moves
+ * to another block. Only the sub-blocks that hold the positions of the
+ * posting are decoded, and none is decoded twice.
+ *
+ * @param cursor Cursor
+ * @param span Output pointer to the first position
+ * @return Number of positions (i.e., the term frequency)
+ */
+int getPositionSpanCursor(Cursor* cursor, unsigned int** span) {
+  int tf = getTfCursor(cursor);
+  if(!cursor->positionsDecoded) {
+    int length = numberOfPositionBlocks(cursor->pool, cursor->pointer) * BLOCK_SIZE;
+    if(length > cursor->positionsLength) {
+      cursor->positions = (unsigned int*)
+        allocateQueryContext(cursor->context, length * sizeof(unsigned int));
+      cursor->positionsLength = length;
+    }
+    cursor->positionsBlock = -1;
+    cursor->positionsHeader = firstPositionSubBlock(cursor->pool, cursor->pointer);
+    cursor->positionsIndex = 0;
+    cursor->positionsOffset = 0;
+    cursor->positionsSpan = -1;
+    cursor->positionsDecoded = 1;
+  }
+
+  // Add up the term frequencies of the postings skipped since last time
+  while(cursor->positionsIndex < cursor->index) {
+    cursor->positionsOffset += cursor->tf[cursor->positionsIndex++];
+  }
+  int offset = cursor->positionsOffset;
+  int first = offset / BLOCK_SIZE, last = (offset + tf - 1) / BLOCK_SIZE;
+  while(cursor->positionsBlock < last) {
+    int block = ++cursor->positionsBlock;
+    if(block >= first) {
+      decompressPositionSubBlock(cursor->pool, &cursor->positions[block * BLOCK_SIZE],
+                                 cursor->pointer, cursor->positionsHeader);
+    }
+    cursor->positionsHeader = nextPositionSubBlock(cursor->pool, cursor->pointer,
+                                                   cursor->positionsHeader);
+  }
+
+  // The first position is stored as is, the rest as gaps
+  unsigned int* positions = &cursor->positions[offset];
+  if(cursor->positionsSpan != cursor->index) {
+    int i;
+    for(i = 1; i < tf; i++) {
+      positions[i] += positions[i - 1];
+    }
+    cursor->positionsSpan = cursor->index;
+  }
+  *span = positions;
+  return tf;
+}
+
+/**
+ * Copies the positions of the current posting into "out," which must
+ * be able to hold getTfCursor(cursor) elements.
+ *
+ * @return Number of positions (i.e., the term frequency)
+ */
+int getPositionsCursor(Cursor* cursor, unsigned int* out) {
+  unsigned int* positions;
+  int tf = getPositionSpanCursor(cursor, &positions);
+  memcpy(out, positions, tf * sizeof(unsigned int));
+  return tf;
+}
+
+/**
+ * Counterpart of getPositionsAsBuffers that reads the positions of the
+ * query terms in a document from positional postings, instead of
+ * decoding the whole document vector. Only the postings of the given
+ * document have their positions decoded. As with document vectors,
+ * buffers[q]->buffer[0] is the number of positions of term q, followed
+ * by the positions themselves.
+ *
+ * Cursors never move backwards, so documents must be visited in
+ * traversal order.
+ *
+ * @param cursors Cursor of every query term
+ * @param qlength Number of query terms
+ * @param docid Document id
+ * @param buffers Output buffers, one per query term
+ */
+void getPositionsAsBuffersCursor(Cursor** cursors, int qlength, unsigned int docid,
+                                 FixedBuffer** buffers) {
+  int q;
+  for(q = 0; q < qlength; q++) {
+    resetFixedBuffer(buffers[q]);
+    Cursor* cursor = cursors[q];
+    if(!nextGEQCursor(cursor, docid) || getDocidCursor(cursor) != docid) {
+      continue;
+    }
+    int tf = getTfCursor(cursor);
+    // Make room for tf positions after the count
+    setFixedBuffer(buffers[q], tf, 0);
+    buffers[q]->buffer[0] = getPositionsCursor(cursor, (unsigned int*) &buffers[q]->buffer[1]);
+  }
+}
+
+/**
+ * Scores the current posting with BM25 (default parameters).
+ */
+float scoreCursor(Cursor* cursor, int* docLen, int totalDocs, float avgDocLen) {
+  return _default_bm25(getTfCursor(cursor), cursor->df, totalDocs,
+                       docLen[getDocidCursor(cursor)], avgDocLen);
+}
+
 #endif
@@ -0,0 +1,179 @@
+/**
+ * Per-query execution context. A QueryContext owns a scratch
+ * arena from which intersection, scoring, and feature extraction code
+ * draw their temporary buffers, so that evaluating a query does not
+ * touch the allocator once the arena has grown to its working size.
+ *
+ * A context is created once per worker thread and reset between queries:
+ *
+ *   QueryContext* context = createQueryContext(DEFAULT_CONTEXT_SIZE);
+ *   for(each query) {
+ *     resetQueryContext(context);
+ *     ...
+ *     int* buffer = (int*) allocateQueryContext(context, n * sizeof(int));
+ *     ...
+ *   }
+ *   destroyQueryContext(context);
+ *
+ * Memory handed out by allocateQueryContext is zeroed and stays valid
+ * until the next reset. It must never be passed to free.
+ */
+
+#ifndef QUERY_CONTEXT_H_GUARD
+#define QUERY_CONTEXT_H_GUARD
+
+#include <stdlib.h>
+#include <string.h>
+#include "buffer/FixedBuffer.h"
+#include "heap/Heap.h"
+
+// Default arena size in bytes
+#define DEFAULT_CONTEXT_SIZE (1 << 20)
+// Alignment of arena allocations (one cache line)
+#define CONTEXT_ALIGNMENT 64
+
+typedef struct QueryContext QueryContext;
+
+struct QueryContext {
+  // Scratch arena
+  char* arena;
+  size_t capacity;
+  size_t used;
+
+  // Allocations that did not fit into the arena since the last reset.
+  // They are released on reset, and the arena grows to absorb them.
+  void** overflow;
+  int overflowCount;
+  int overflowCapacity;
+  size_t overflowBytes;
+
+  // Top-k heap shared by the disjunctive algorithms
+  Heap* heap;
+
+  // Per-term position buffers used in feature extraction
+  FixedBuffer** buffers;
+  int numberOfBuffers;
+};
+
+/**
+ * Creates a new query context.
+ *
+ * @param initialSize Initial size of the arena in bytes
+ * @return A new query context
+ */
+QueryContext* createQueryContext(size_t initialSize) {
+  QueryContext* context = (QueryContext*) malloc(sizeof(QueryContext));
+  initialSize = (initialSize + CONTEXT_ALIGNMENT - 1) & ~((size_t) CONTEXT_ALIGNMENT - 1);
+  context->capacity = initialSize;
+  context->arena = (char*) aligned_alloc(CONTEXT_ALIGNMENT, initialSize);
+  context->used = 0;
+  context->overflowCapacity = 16;
+  context->overflow = (void**) malloc(context->overflowCapacity * sizeof(void*));
+  context->overflowCount = 0;
+  context->overflowBytes = 0;
+  context->heap = NULL;
+  context->buffers = NULL;
+  context->numberOfBuffers = 0;
+  return context;
+}
+
+void destroyQueryContext(QueryContext* context) {
+  int i;
+  for(i = 0; i < context->overflowCount; i++) {
+    free(context->overflow[i]);
+  }
+  for(i = 0; i < context->numberOfBuffers; i++) {
+    destroyFixedBuffer(context->buffers[i]);
+  }
+  if(context->buffers) free(context->buffers);
+  if(context->heap) destroyHeap(context->heap);
+  free(context->overflow);
+  free(context->arena);
+  free(context);
+}
+
+/**
+ * Releases everything allocated since the last reset. If the previous
+ * query did not fit into the arena, the arena is enlarged so that
+ * the next query of the same size is served without overflow.
+ */
+void resetQueryContext(QueryContext* context) {
+  if(context->overflowCount > 0) {
+    int i;
+    for(i = 0; i < context->overflowCount; i++) {
+      free(context->overflow[i]);
+    }
+    size_t newCapacity = (context->capacity + context->overflowBytes) * 2;
+    free(context->arena);
+    context->arena = (char*) aligned_alloc(CONTEXT_ALIGNMENT, newCapacity);
+    context->capacity = newCapacity;
+    context->overflowCount = 0;
+    context->overflowBytes = 0;
+  }
+  context->used = 0;
+}
+
+/**
+ * Allocates a zeroed, cache-line aligned buffer from the arena.
+ *
+ * @param context Query context
+ * @param size Size of the buffer in bytes
+ * @return A buffer that is valid until the next reset
+ */
+void* allocateQueryContext(QueryContext* context, size_t size) {
+  size = (size + CONTEXT_ALIGNMENT - 1) & ~((size_t) CONTEXT_ALIGNMENT - 1);
+  if(size == 0) {
+    size = CONTEXT_ALIGNMENT;
+  }
+
+  void* buffer;
+  if(context->used + size <= context->capacity) {
+    buffer = context->arena + context->used;
+    context->used += size;
+  } else {
+    if(context->overflowCount == context->overflowCapacity) {
+      context->overflowCapacity *= 2;
+      context->overflow = (void**) realloc(context->overflow,
+                                           context->overflowCapacity * sizeof(void*));
+    }
+    buffer = aligned_alloc(CONTEXT_ALIGNMENT, size);
+    context->overflow[context->overflowCount++] = buffer;
+    context->overflowBytes += size;
+  }
+  memset(buffer, 0, size);
+  return buffer;
+}
+
+/**
+ * Returns an empty heap that can hold "hits" elements. The heap is
+ * only re-created when the number of hits changes.
+ */
+Heap* getHeapQueryContext(QueryContext* context, int hits) {
+  if(context->heap && context->heap->size != hits + 2) {
+    destroyHeap(context->heap);
+    context->heap = NULL;
+  }
+  if(!context->heap) {
+    context->heap = initHeap(hits);
+  }
+  clearHeap(context->heap);
+  return context->heap;
+}
+
+/**
+ * Returns "n" position buffers, one per query term. Buffers are kept
+ * (and keep their expanded size) across queries.
+ */
+FixedBuffer** getBuffersQueryContext(QueryContext* context, int n) {
+  if(n > context->numberOfBuffers) {
+    context->buffers = (FixedBuffer**) realloc(context->buffers, n * sizeof(FixedBuffer*));
+    int i;
+    for(i = context->numberOfBuffers; i < n; i++) {
+      context->buffers[i] = createFixedBuffer(10);
+    }
+    context->numberOfBuffers = n;
+  }
+  return context->buffers;
+}
+
+#endif
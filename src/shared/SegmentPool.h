@@ -6,12 +6,17 @@
 #include <string.h>
 #include "pfordelta/opt_p4.h"
 #include "bloom/BloomFilter.h"
+#include "bitmap/BitmapContainer.h"
 
 // Pool size
 #define MAX_INT_VALUE ((unsigned int) 0xFFFFFFFF)
 // Null pointers to determine the end of a postings list
 #define UNDEFINED_POINTER -1l
 #define UNKNOWN_SEGMENT -1
+// Number of segments per entry in a skip list
+#define SKIP_INTERVAL 4
+// Alignment of each pool, in bytes (a cache line)
+#define SEGMENT_POOL_ALIGNMENT 64
 
 // Operators defined based on whether or not the postings are backwards
 #define LESS_THAN(X,Y,R) (R == 0 ? (X < Y) : (X > Y))
@@ -37,10 +42,45 @@ struct SegmentPool {
 
   // if Bloom filters enabled
   int bloomEnabled;
+  // ADAPTIVE_NB_HASH if filters are sized per term
   unsigned int nbHash;
   unsigned int bitsPerElement;
+  // Target false positive rate, when filters are sized per term
+  // (only used while indexing, not stored)
+  float targetFpr;
+  // Minimum density of docid blocks stored as bitmap containers,
+  // or 0 if disabled (only used while indexing, not stored)
+  float bitmapDensity;
 };
 
+/**
+ * Allocates a pool of MAX_INT_VALUE ints, aligned to a cache line, so
+ * that data aligned relative to the start of a pool (e.g., blocked Bloom
+ * filters) is aligned in memory too, wherever the pool is loaded.
+ */
+int* allocateSegmentPoolArray() {
+  void* array = NULL;
+  if(posix_memalign(&array, SEGMENT_POOL_ALIGNMENT, MAX_INT_VALUE * sizeof(int)) != 0) {
+    return NULL;
+  }
+  return (int*) array;
+}
+
+/**
+ * Moves the offset of the current pool to where the next segment may
+ * start. With blocked Bloom filters, segments start on a filter block
+ * boundary, so that the padding of a filter, which is relative to the
+ * start of its segment, still aligns it once the segment is copied to
+ * another offset (see readPostingsForTerm).
+ */
+void alignSegmentPoolOffset(SegmentPool* pool) {
+  if(pool->bloomEnabled == BLOOM_FILTER_BLOCKED) {
+    unsigned int words = BLOCKED_BLOOM_FILTER_ALIGNMENT / sizeof(int);
+    unsigned long offset = ((pool->offset + (unsigned long) words - 1) / words) * words;
+    pool->offset = offset > MAX_INT_VALUE ? MAX_INT_VALUE : offset;
+  }
+}
+
 void writeSegmentPool(SegmentPool* pool, FILE* fp) {
   fwrite(&pool->segment, sizeof(unsigned int), 1, fp);
   fwrite(&pool->offset, sizeof(unsigned int), 1, fp);
@@ -64,14 +104,16 @@ SegmentPool* readSegmentPool(FILE* fp) {
   fread(&pool->bloomEnabled, sizeof(int), 1, fp);
   fread(&pool->nbHash, sizeof(unsigned int), 1, fp);
   fread(&pool->bitsPerElement, sizeof(unsigned int), 1, fp);
+  pool->targetFpr = 0;
+  pool->bitmapDensity = 0;
 
   pool->pool = (int**) malloc((pool->segment + 1) * sizeof(int*));
   int i;
   for(i = 0; i < pool->segment; i++) {
-    pool->pool[i] = (int*) calloc(MAX_INT_VALUE, sizeof(int));
+    pool->pool[i] = allocateSegmentPoolArray();
     fread(pool->pool[i], sizeof(int), MAX_INT_VALUE, fp);
   }
-  pool->pool[pool->segment] = (int*) calloc(MAX_INT_VALUE, sizeof(int));
+  pool->pool[pool->segment] = allocateSegmentPoolArray();
   fread(pool->pool[pool->segment], sizeof(int), pool->offset, fp);
   return pool;
 }
@@ -99,6 +141,10 @@ int readReverseFlag(FILE* fp) {
  * @param bitsPerElement If Bloom filter chains are enabled,
  *        this indicates number of bits per element
  * @return A new segment pool kept in the main memory
+ *
+ * To size filters per term instead, set "targetFpr" on the new pool
+ * (and, for classic filters, pass ADAPTIVE_NB_HASH as "nbHash").
+ * To store dense docid blocks as bitmap containers, set "bitmapDensity."
  */
 SegmentPool* createSegmentPool(int numberOfPools, int reverse, int bloomEnabled,
                                  int nbHash, int bitsPerElement) {
@@ -106,7 +152,7 @@ SegmentPool* createSegmentPool(int numberOfPools, int reverse, int bloomEnabled,
   pool->pool = (int**) malloc(numberOfPools * sizeof(int*));
   int i;
   for(i = 0; i < numberOfPools; i++) {
-    pool->pool[i] = (int*) calloc(MAX_INT_VALUE, sizeof(int));
+    pool->pool[i] = allocateSegmentPoolArray();
   }
   pool->segment = 0;
   pool->offset = 0;
@@ -114,6 +160,8 @@ SegmentPool* createSegmentPool(int numberOfPools, int reverse, int bloomEnabled,
   pool->bloomEnabled = bloomEnabled;
   pool->nbHash = nbHash;
   pool->bitsPerElement = bitsPerElement;
+  pool->targetFpr = 0;
+  pool->bitmapDensity = 0;
   pool->reverse = reverse;
   return pool;
 }
@@ -131,9 +179,10 @@ void destroySegmentPool(SegmentPool* pool) {
  * Whether or not the index contains term frequency (tf) information
  */
 int isTermFrequencyPresent(SegmentPool* pool) {
-  int reqspace = pool->pool[0][0];
-  int csize = pool->pool[0][4];
-  if(csize + 5 == reqspace) {
+  // Bloom filters (if any) follow the last block of a segment
+  int filterOffset = pool->pool[0][4];
+  int csize = pool->pool[0][6];
+  if(csize + 7 == filterOffset) {
     return 0;
   }
   return 1;
@@ -143,18 +192,151 @@ int isTermFrequencyPresent(SegmentPool* pool) {
  * Whether or not the index is a positional inverted index.
  */
 int isPositional(SegmentPool* pool) {
-  int reqspace = pool->pool[0][0];
-  int csize = pool->pool[0][4];
-  if(csize + 5 == reqspace) {
+  int filterOffset = pool->pool[0][4];
+  int csize = pool->pool[0][6];
+  if(csize + 7 == filterOffset) {
     return 0;
   }
-  int tfcsize = pool->pool[0][csize + 5];
-  if(csize + tfcsize + 6 == reqspace) {
+  int tfcsize = pool->pool[0][csize + 7];
+  if(csize + tfcsize + 8 == filterOffset) {
     return 0;
   }
   return 1;
 }
 
+/**
+ * Whether a block of docids should be stored as a bitmap container:
+ * bitmaps must be enabled, the block must be dense enough, and the
+ * bitmap must not take more space than the uncompressed block.
+ */
+int useBitmapContainer(SegmentPool* pool, unsigned int* data, unsigned int len) {
+  if(pool->bitmapDensity <= 0) {
+    return 0;
+  }
+  unsigned int first = data[0] < data[len - 1] ? data[0] : data[len - 1];
+  unsigned int last = data[0] < data[len - 1] ? data[len - 1] : data[0];
+  if(computeBitmapContainerLength(first, last) > BLOCK_SIZE) {
+    return 0;
+  }
+  return len >= pool->bitmapDensity * (last - first + 1);
+}
+
+/**
+ * Builds the Bloom filter of a segment, if Bloom filter chains are enabled.
+ * If the pool sizes filters per term, the number of bits per element
+ * (and, for classic filters, of hash functions) is derived from the
+ * target false positive rate and the document frequency of the term.
+ *
+ * @param pool Segment pool
+ * @param data Document ids
+ * @param len Number of document ids
+ * @param df Document frequency of the term so far
+ * @param filterSize Set to the length of the filter in number of ints
+ * @param filterSpace Set to the number of ints the filter occupies in
+ *        the segment, not counting its length field
+ * @param nbHash Set to the number of hash functions of the filter
+ * @return The filter (to be freed by the caller), or NULL if Bloom
+ *         filter chains are disabled
+ */
+unsigned int* createSegmentBloomFilter(SegmentPool* pool, unsigned int* data,
+                                       unsigned int len, unsigned int df,
+                                       unsigned int* filterSize,
+                                       unsigned int* filterSpace,
+                                       unsigned int* nbHash) {
+  *filterSize = 0;
+  *filterSpace = 0;
+  *nbHash = pool->nbHash;
+  if(!pool->bloomEnabled) {
+    return NULL;
+  }
+
+  int bitsPerElement = pool->bitsPerElement;
+  if(pool->targetFpr > 0) {
+    bitsPerElement = computeBitsPerElement(computeTermFalsePositiveRate(pool->targetFpr, df));
+    // Blocked filters always set one bit per word of a block
+    if(pool->nbHash == ADAPTIVE_NB_HASH) {
+      *nbHash = computeNbHash(bitsPerElement);
+    }
+  }
+
+  unsigned int* filter;
+  int i;
+  if(pool->bloomEnabled == BLOOM_FILTER_BLOCKED) {
+    *filterSize = computeBlockedBloomFilterLength(len, bitsPerElement);
+    // One int recording the padding, and room to align the filter
+    *filterSpace = *filterSize + BLOCKED_BLOOM_FILTER_WORDS;
+    filter = (unsigned int*) calloc(*filterSize, sizeof(unsigned int));
+    for(i = 0; i < len; i++) {
+      insertIntoBlockedBloomFilter(filter, *filterSize, data[i]);
+    }
+  } else {
+    *filterSize = computeBloomFilterLength(len, bitsPerElement);
+    *filterSpace = *filterSize;
+    if(pool->nbHash == ADAPTIVE_NB_HASH) {
+      // The number of hash functions is stored with the filter
+      (*filterSpace)++;
+    }
+    filter = (unsigned int*) calloc(*filterSize, sizeof(unsigned int));
+    for(i = 0; i < len; i++) {
+      insertIntoBloomFilter(filter, *filterSize, *nbHash, data[i]);
+    }
+  }
+  return filter;
+}
+
+/**
+ * Writes a Bloom filter into the current segment, starting at "offset."
+ * A blocked filter is preceded by the number of padding ints that
+ * align it to its block size, so that each block sits in a single
+ * cache line. A classic filter of a pool that sizes filters per term
+ * is preceded by its number of hash functions.
+ */
+void writeSegmentBloomFilter(SegmentPool* pool, unsigned int offset,
+                             unsigned int* filter, unsigned int filterSize,
+                             unsigned int nbHash) {
+  int* out = &pool->pool[pool->segment][offset];
+  out[0] = filterSize;
+  if(pool->bloomEnabled == BLOOM_FILTER_BLOCKED) {
+    // Pools are aligned, and segments start on a block boundary (see
+    // alignSegmentPoolOffset), so the padding only depends on the offset
+    unsigned int words = BLOCKED_BLOOM_FILTER_ALIGNMENT / sizeof(int);
+    unsigned int padding = (words - (offset + 2) % words) % words;
+    out[1] = padding;
+    memcpy(&out[2 + padding], filter, filterSize * sizeof(int));
+  } else if(pool->nbHash == ADAPTIVE_NB_HASH) {
+    out[1] = nbHash;
+    memcpy(&out[2], filter, filterSize * sizeof(int));
+  } else {
+    memcpy(&out[1], filter, filterSize * sizeof(int));
+  }
+}
+
+/**
+ * Locates the Bloom filter of a segment.
+ *
+ * @param pool Segment pool
+ * @param pSegment Segment
+ * @param pOffset Offset of the segment
+ * @param filterSize Set to the length of the filter in number of ints
+ * @param nbHash Set to the number of hash functions (classic filters only)
+ * @return The filter
+ */
+unsigned int* getSegmentBloomFilter(SegmentPool* pool, int pSegment, unsigned int pOffset,
+                                    unsigned int* filterSize, unsigned int* nbHash) {
+  unsigned int bloomOffset = pool->pool[pSegment][pOffset + 4];
+  unsigned int* filter = (unsigned int*) &pool->pool[pSegment][pOffset + bloomOffset];
+  *filterSize = filter[0];
+  *nbHash = pool->nbHash;
+  if(pool->bloomEnabled == BLOOM_FILTER_BLOCKED) {
+    return &filter[2 + filter[1]];
+  }
+  if(pool->nbHash == ADAPTIVE_NB_HASH) {
+    *nbHash = filter[1];
+    return &filter[2];
+  }
+  return &filter[1];
+}
+
 /**
  * Compress and write a segment into a non-positional segment pool,
  * and link it to the previous segment (if present)
@@ -162,11 +344,12 @@ int isPositional(SegmentPool* pool) {
  * @param pool Segment pool
  * @param data Document ids
  * @param len Number of document ids
+ * @param df Document frequency of the term so far (to size its Bloom filter)
  * @param tailPointer Pointer to the previous segment
  * @return Pointer to the new segment
  */
 long compressAndAddNonPositional(SegmentPool* pool, unsigned int* data,
-                                 unsigned int len, long tailPointer) {
+                                 unsigned int len, unsigned int df, long tailPointer) {
   int lastSegment = -1;
   unsigned int lastOffset = 0;
   if(tailPointer != UNDEFINED_POINTER) {
@@ -174,17 +357,12 @@ long compressAndAddNonPositional(SegmentPool* pool, unsigned int* data,
     lastOffset = DECODE_OFFSET(tailPointer);
   }
 
-  // Construct a Bloom filter if required
-  unsigned int* filter = 0;
-  unsigned int filterSize = 0;
-  if(pool->bloomEnabled) {
-    filterSize = computeBloomFilterLength(len, pool->bitsPerElement);
-    filter = (unsigned int*) calloc(filterSize, sizeof(unsigned int));
-    int i;
-    for(i = 0; i < len; i++) {
-      insertIntoBloomFilter(filter, filterSize, pool->nbHash, data[i]);
-    }
-  }
+  // Construct a Bloom filter if required. Bitmap containers are
+  // tested exactly, and need none.
+  int bitmap = useBitmapContainer(pool, data, len);
+  unsigned int filterSize = 0, filterSpace = 0, nbHash = 0;
+  unsigned int* filter = bitmap ? NULL :
+    createSegmentBloomFilter(pool, data, len, df, &filterSize, &filterSpace, &nbHash);
 
   unsigned int maxDocId = pool->reverse ? data[0] : data[len - 1];
   unsigned int* block = (unsigned int*) calloc(BLOCK_SIZE*2, sizeof(unsigned int));
@@ -196,9 +374,11 @@ long compressAndAddNonPositional(SegmentPool* pool, unsigned int* data,
       data[len - i - 1] = t;
     }
   }
-  unsigned int csize = OPT4(data, len, block, 1);
+  unsigned int csize = bitmap ? encodeBitmapContainer(data, len, block) :
+    OPT4(data, len, block, 1);
 
-  int reqspace = csize + filterSize + 8;
+  int reqspace = csize + filterSpace + 8;
+  alignSegmentPoolOffset(pool);
   if(reqspace > (MAX_INT_VALUE - pool->offset)) {
     pool->segment++;
     pool->offset = 0;
@@ -217,9 +397,7 @@ long compressAndAddNonPositional(SegmentPool* pool, unsigned int* data,
          block, csize * sizeof(int));
 
   if(filter) {
-    pool->pool[pool->segment][pool->offset + csize + 7] = filterSize;
-    memcpy(&pool->pool[pool->segment][pool->offset + csize + 8],
-           filter, filterSize * sizeof(int));
+    writeSegmentBloomFilter(pool, pool->offset + csize + 7, filter, filterSize, nbHash);
   }
 
   if(lastSegment >= 0) {
@@ -248,12 +426,14 @@ long compressAndAddNonPositional(SegmentPool* pool, unsigned int* data,
  * @param data Document ids
  * @param tf Term frequencies
  * @param len Number of document ids
+ * @param df Document frequency of the term so far (to size its Bloom filter)
  * @param tailPointer Pointer to the previous segment
  * @return Pointer to the new segment
  */
 
 long compressAndAddTfOnly(SegmentPool* pool, unsigned int* data,
-                          unsigned int* tf, unsigned int len, long tailPointer) {
+                          unsigned int* tf, unsigned int len, unsigned int df,
+                          long tailPointer) {
   int lastSegment = -1;
   unsigned int lastOffset = 0;
   if(tailPointer != UNDEFINED_POINTER) {
@@ -261,17 +441,12 @@ long compressAndAddTfOnly(SegmentPool* pool, unsigned int* data,
     lastOffset = DECODE_OFFSET(tailPointer);
   }
 
-  // Construct a Bloom filter if required
-  unsigned int* filter = 0;
-  unsigned int filterSize = 0;
-  if(pool->bloomEnabled) {
-    filterSize = computeBloomFilterLength(len, pool->bitsPerElement);
-    filter = (unsigned int*) calloc(filterSize, sizeof(unsigned int));
-    int i;
-    for(i = 0; i < len; i++) {
-      insertIntoBloomFilter(filter, filterSize, pool->nbHash, data[i]);
-    }
-  }
+  // Construct a Bloom filter if required. Bitmap containers are
+  // tested exactly, and need none.
+  int bitmap = useBitmapContainer(pool, data, len);
+  unsigned int filterSize = 0, filterSpace = 0, nbHash = 0;
+  unsigned int* filter = bitmap ? NULL :
+    createSegmentBloomFilter(pool, data, len, df, &filterSize, &filterSpace, &nbHash);
 
   unsigned int maxDocId = pool->reverse ? data[0] : data[len - 1];
 
@@ -290,10 +465,12 @@ long compressAndAddTfOnly(SegmentPool* pool, unsigned int* data,
 
   unsigned int* block = (unsigned int*) calloc(BLOCK_SIZE*2, sizeof(unsigned int));
   unsigned int* tfblock = (unsigned int*) calloc(BLOCK_SIZE*2, sizeof(unsigned int));
-  unsigned int csize = OPT4(data, len, block, 1);
+  unsigned int csize = bitmap ? encodeBitmapContainer(data, len, block) :
+    OPT4(data, len, block, 1);
   unsigned int tfcsize = OPT4(tf, len, tfblock, 0);
 
-  int reqspace = csize + tfcsize + filterSize + 9;
+  int reqspace = csize + tfcsize + filterSpace + 9;
+  alignSegmentPoolOffset(pool);
   if(reqspace > (MAX_INT_VALUE - pool->offset)) {
     pool->segment++;
     pool->offset = 0;
@@ -315,9 +492,8 @@ long compressAndAddTfOnly(SegmentPool* pool, unsigned int* data,
          tfblock, tfcsize * sizeof(int));
 
   if(filter) {
-    pool->pool[pool->segment][pool->offset + csize + tfcsize + 8] = filterSize;
-    memcpy(&pool->pool[pool->segment][pool->offset + 9 + csize + tfcsize],
-           filter, filterSize * sizeof(int));
+    writeSegmentBloomFilter(pool, pool->offset + csize + tfcsize + 8, filter, filterSize,
+                            nbHash);
   }
 
   if(lastSegment >= 0) {
@@ -350,13 +526,14 @@ long compressAndAddTfOnly(SegmentPool* pool, unsigned int* data,
  * @param positions List of gap-encoded term positions
  * @param len Number of document ids
  * @param plen Number of positions
+ * @param df Document frequency of the term so far (to size its Bloom filter)
  * @param tailPointer Pointer to the previous segment
  * @return Pointer to the new segment
  */
 
 long compressAndAddPositional(SegmentPool* pool, unsigned int* data,
     unsigned int* tf, unsigned int* positions,
-    unsigned int len, unsigned int plen, long tailPointer) {
+    unsigned int len, unsigned int plen, unsigned int df, long tailPointer) {
   int lastSegment = -1;
   unsigned int lastOffset = 0;
   if(tailPointer != UNDEFINED_POINTER) {
@@ -364,17 +541,12 @@ long compressAndAddPositional(SegmentPool* pool, unsigned int* data,
     lastOffset = DECODE_OFFSET(tailPointer);
   }
 
-  // Construct a Bloom filter if required
-  unsigned int* filter = 0;
-  unsigned int filterSize = 0;
-  if(pool->bloomEnabled) {
-    filterSize = computeBloomFilterLength(len, pool->bitsPerElement);
-    filter = (unsigned int*) calloc(filterSize, sizeof(unsigned int));
-    int i;
-    for(i = 0; i < len; i++) {
-      insertIntoBloomFilter(filter, filterSize, pool->nbHash, data[i]);
-    }
-  }
+  // Construct a Bloom filter if required. Bitmap containers are
+  // tested exactly, and need none.
+  int bitmap = useBitmapContainer(pool, data, len);
+  unsigned int filterSize = 0, filterSpace = 0, nbHash = 0;
+  unsigned int* filter = bitmap ? NULL :
+    createSegmentBloomFilter(pool, data, len, df, &filterSize, &filterSpace, &nbHash);
 
   unsigned int maxDocId = pool->reverse ? data[0] : data[len - 1];
 
@@ -406,7 +578,8 @@ long compressAndAddPositional(SegmentPool* pool, unsigned int* data,
   unsigned int* block = (unsigned int*) calloc(BLOCK_SIZE*2, sizeof(unsigned int));
   unsigned int* tfblock = (unsigned int*) calloc(BLOCK_SIZE*2, sizeof(unsigned int));
   unsigned int* pblock = (unsigned int*) calloc(pblocksize, sizeof(unsigned int));
-  unsigned int csize = OPT4(data, len, block, 1);
+  unsigned int csize = bitmap ? encodeBitmapContainer(data, len, block) :
+    OPT4(data, len, block, 1);
   unsigned int tfcsize = OPT4(tf, len, tfblock, 0);
 
   // compressing positions
@@ -432,7 +605,8 @@ long compressAndAddPositional(SegmentPool* pool, unsigned int* data,
   }
   // end compressing positions
 
-  int reqspace = csize + tfcsize + pcsize + filterSize + 11;
+  int reqspace = csize + tfcsize + pcsize + filterSpace + 11;
+  alignSegmentPoolOffset(pool);
   if(reqspace > (MAX_INT_VALUE - pool->offset)) {
     pool->segment++;
     pool->offset = 0;
@@ -459,9 +633,8 @@ long compressAndAddPositional(SegmentPool* pool, unsigned int* data,
          pblock, pcsize * sizeof(int));
 
   if(filter) {
-    pool->pool[pool->segment][pool->offset + csize + tfcsize + pcsize + 10] = filterSize;
-    memcpy(&pool->pool[pool->segment][pool->offset + 11 + csize + tfcsize + pcsize],
-         filter, filterSize * sizeof(int));
+    writeSegmentBloomFilter(pool, pool->offset + csize + tfcsize + pcsize + 10,
+                            filter, filterSize, nbHash);
   }
 
   if(lastSegment >= 0) {
@@ -509,6 +682,35 @@ long nextPointer(SegmentPool* pool, long pointer) {
                         pool->pool[pSegment][pOffset + 2]);
 }
 
+/**
+ * Returns the docid stored in the header of the segment pointed to by
+ * "pointer." This is the last docid of the block in traversal order
+ * (i.e., the smallest one if postings are backwards), so a block can
+ * be skipped without decompressing it.
+ */
+unsigned int getMaxDocId(SegmentPool* pool, long pointer) {
+  int pSegment = DECODE_SEGMENT(pointer);
+  unsigned int pOffset = DECODE_OFFSET(pointer);
+  return pool->pool[pSegment][pOffset + 3];
+}
+
+/**
+ * Returns the compressed docid block of the segment pointed to by "pointer."
+ */
+unsigned int* getDocidBlock(SegmentPool* pool, long pointer) {
+  int pSegment = DECODE_SEGMENT(pointer);
+  unsigned int pOffset = DECODE_OFFSET(pointer);
+  return (unsigned int*) &pool->pool[pSegment][pOffset + 7];
+}
+
+/**
+ * Whether the docid block of the segment pointed to by "pointer"
+ * is stored as a bitmap container.
+ */
+int isBitmapContainer(SegmentPool* pool, long pointer) {
+  return (getDocidBlock(pool, pointer)[0] & BITMAP_CONTAINER_FLAG) != 0;
+}
+
 /**
  * Decompresses the docid block from the segment pointed to by "pointer,"
  * into the "outBlock" buffer. Block size is 128.
@@ -519,8 +721,12 @@ int decompressDocidBlock(SegmentPool* pool, unsigned int* outBlock, long pointer
   int pSegment = DECODE_SEGMENT(pointer);
   unsigned int pOffset = DECODE_OFFSET(pointer);
 
+  unsigned int* block = (unsigned int*) &pool->pool[pSegment][pOffset + 7];
+  if(block[0] & BITMAP_CONTAINER_FLAG) {
+    return decodeBitmapContainer(block, outBlock, pool->reverse);
+  }
+
   unsigned int aux[BLOCK_SIZE*4];
-  unsigned int* block = &pool->pool[pSegment][pOffset + 7];
   detailed_p4_decode(outBlock, block, aux, 1, pool->reverse);
 
   return pool->pool[pSegment][pOffset + 5];
@@ -580,85 +786,246 @@ int decompressPositionBlock(SegmentPool* pool, unsigned int* outBlock, long poin
   return pool->pool[pSegment][pOffset + csize + tfsize + 8];
 }
 
-void decompressPositions(SegmentPool* pool, unsigned int* tf,
-                         int index, long pointer, int* out) {
+/**
+ * Returns the offset, within its segment, of the first position
+ * sub-block of the block pointed to by "pointer." Positions are stored
+ * in sub-blocks of BLOCK_SIZE, each preceded by its compressed size,
+ * so that they can be decoded one at a time.
+ */
+unsigned int firstPositionSubBlock(SegmentPool* pool, long pointer) {
   int pSegment = DECODE_SEGMENT(pointer);
   unsigned int pOffset = DECODE_OFFSET(pointer);
 
-  unsigned int aux[BLOCK_SIZE*4];
   unsigned int csize = pool->pool[pSegment][pOffset + 6];
   unsigned int tfsize = pool->pool[pSegment][pOffset + 7 + csize];
-  int nb = 0;
-  int i;
-  for(i = 0; i < index; i++) {
-    nb += tf[i];
+  return pOffset + csize + tfsize + 10;
+}
+
+/**
+ * Returns the offset of the position sub-block that follows the one
+ * at "offset," without decoding it.
+ */
+unsigned int nextPositionSubBlock(SegmentPool* pool, long pointer, unsigned int offset) {
+  return offset + pool->pool[DECODE_SEGMENT(pointer)][offset] + 1;
+}
+
+/**
+ * Decompresses the position sub-block at "offset" into "outBlock,"
+ * which must be able to hold BLOCK_SIZE positions. Positions are gaps
+ * within a document; the first position of each document is stored
+ * as is.
+ */
+void decompressPositionSubBlock(SegmentPool* pool, unsigned int* outBlock,
+                                long pointer, unsigned int offset) {
+  unsigned int aux[BLOCK_SIZE*4];
+  detailed_p4_decode(outBlock, &pool->pool[DECODE_SEGMENT(pointer)][offset + 1],
+                     aux, 0, pool->reverse);
+}
+
+/**
+ * A skip list over the segments of one postings list. Segments are
+ * sampled every SKIP_INTERVAL hops; for each group of segments, the
+ * list keeps a pointer to its first segment and the last docid of its
+ * last segment. A lookup binary searches the groups, then follows at
+ * most SKIP_INTERVAL - 1 links, instead of walking the whole chain.
+ */
+typedef struct SkipList SkipList;
+
+struct SkipList {
+  // Number of groups
+  int length;
+  // Last docid (in traversal order) of the last segment of each group
+  unsigned int* maxDocId;
+  // Pointer to the first segment of each group
+  long* pointers;
+};
+
+/**
+ * Builds the skip list of the chain that starts at "headPointer."
+ */
+SkipList* createSkipList(SegmentPool* pool, long headPointer) {
+  SkipList* list = (SkipList*) malloc(sizeof(SkipList));
+  int segments = 0;
+  long pointer = headPointer;
+  while(pointer != UNDEFINED_POINTER) {
+    segments++;
+    pointer = nextPointer(pool, pointer);
   }
-  int lnb = nb + tf[i] - 1;
-  int r = nb % BLOCK_SIZE;
-  nb = nb / BLOCK_SIZE;
-  lnb = lnb / BLOCK_SIZE;
 
-  unsigned int pos = pOffset + csize + tfsize + 10;
-  for(i = 0; i < nb; i++) {
-    pos += pool->pool[pSegment][pos] + 1;
+  list->length = (segments + SKIP_INTERVAL - 1) / SKIP_INTERVAL;
+  list->maxDocId = (unsigned int*) malloc(list->length * sizeof(unsigned int));
+  list->pointers = (long*) malloc(list->length * sizeof(long));
+
+  int i = 0;
+  pointer = headPointer;
+  while(pointer != UNDEFINED_POINTER) {
+    if(i % SKIP_INTERVAL == 0) {
+      list->pointers[i / SKIP_INTERVAL] = pointer;
+    }
+    list->maxDocId[i / SKIP_INTERVAL] = getMaxDocId(pool, pointer);
+    i++;
+    pointer = nextPointer(pool, pointer);
   }
-  int cindex = 0, left = tf[index], tocopy = tf[index], rindex = r;
-  for(i = nb; i <= lnb; i++) {
-    if(rindex + tocopy > BLOCK_SIZE) {
-      tocopy = BLOCK_SIZE - rindex;
+  return list;
+}
+
+void destroySkipList(SkipList* list) {
+  free(list->maxDocId);
+  free(list->pointers);
+  free(list);
+}
+
+/**
+ * Moves "pointer" forward to the first segment of its chain whose last
+ * docid is not less than "docid." If the target is more than
+ * SKIP_INTERVAL segments away and a skip list is available, the walk
+ * continues from the first segment of the group that contains the target.
+ *
+ * @param pool Segment pool
+ * @param list Skip list of the chain, or NULL
+ * @param pointer Pointer to the current segment
+ * @param docid Target document id
+ * @return Pointer to the segment that may contain "docid," or
+ *         UNDEFINED_POINTER if the chain ends before it
+ */
+long seekSegment(SegmentPool* pool, SkipList* list, long pointer, unsigned int docid) {
+  // Nearby targets are reached faster by following links
+  int hops;
+  for(hops = 0; hops <= SKIP_INTERVAL; hops++) {
+    if(pointer == UNDEFINED_POINTER ||
+       !LESS_THAN(getMaxDocId(pool, pointer), docid, pool->reverse)) {
+      return pointer;
     }
-    unsigned int* block = &pool->pool[pSegment][pos + 1];
-    unsigned int* temp = (unsigned int*) calloc(BLOCK_SIZE * 2, sizeof(unsigned int));
-    detailed_p4_decode(temp, block, aux, 0, pool->reverse);
-    memcpy(&out[cindex], &temp[rindex], tocopy * sizeof(int));
-    pos += pool->pool[pSegment][pos] + 1;
-    free(temp);
+    pointer = nextPointer(pool, pointer);
+  }
 
-    cindex += tocopy;
-    left -= tocopy;
-    tocopy = left;
-    rindex = 0;
+  if(list) {
+    int low = 0, high = list->length;
+    while(low < high) {
+      int middle = (low + high) >> 1;
+      if(LESS_THAN(list->maxDocId[middle], docid, pool->reverse)) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    if(low == list->length) {
+      return UNDEFINED_POINTER;
+    }
+    pointer = list->pointers[low];
   }
-  for(i = 1; i < tf[index]; i++) {
-    out[i] += out[i - 1];
+
+  while(pointer != UNDEFINED_POINTER &&
+        LESS_THAN(getMaxDocId(pool, pointer), docid, pool->reverse)) {
+    pointer = nextPointer(pool, pointer);
   }
+  return pointer;
 }
 
 /**
- * If Bloom filter chains are present, perform a membership test
+ * If Bloom filter chains are present, perform a membership test.
+ * Segments stored as bitmap containers give an exact answer.
  *
  * @param pool Segment pool
+ * @param list Skip list of the chain, or NULL
  * @param docid Test document id
  * @param pointer Pointer to segment
  * @return Whether or not input docid exists in the Bloom filter chain
  */
-int containsDocid(SegmentPool* pool, unsigned int docid, long* pointer) {
+int containsDocid(SegmentPool* pool, SkipList* list, unsigned int docid, long* pointer) {
+  *pointer = seekSegment(pool, list, *pointer, docid);
   if(*pointer == UNDEFINED_POINTER) {
     return 0;
   }
   int pSegment = DECODE_SEGMENT(*pointer);
   unsigned int pOffset = DECODE_OFFSET(*pointer);
 
-  while(LESS_THAN(pool->pool[pSegment][pOffset + 3], docid, pool->reverse)) {
-    int nSegment = pool->pool[pSegment][pOffset + 1];
-    int nOffset = pool->pool[pSegment][pOffset + 2];
-    pSegment = nSegment;
-    pOffset = nOffset;
-    if(pSegment == UNKNOWN_SEGMENT) {
-      *pointer = UNDEFINED_POINTER;
-      return 0;
-    }
-  }
-
   if(pool->pool[pSegment][pOffset + 3] == docid) {
     return 1;
   }
 
-  unsigned int bloomOffset = pool->pool[pSegment][pOffset + 4];
-  *pointer = ENCODE_POINTER(pSegment, pOffset);
-  return containsBloomFilter(&pool->pool[pSegment][pOffset + bloomOffset + 1],
-                             pool->pool[pSegment][pOffset + bloomOffset],
-                             pool->nbHash, docid);
+  // Dense segments are tested exactly, with a single bit test
+  unsigned int* block = (unsigned int*) &pool->pool[pSegment][pOffset + 7];
+  if(block[0] & BITMAP_CONTAINER_FLAG) {
+    return containsBitmapContainer(block, docid);
+  }
+
+  unsigned int filterSize, nbHash;
+  unsigned int* filter = getSegmentBloomFilter(pool, pSegment, pOffset, &filterSize, &nbHash);
+  if(pool->bloomEnabled == BLOOM_FILTER_BLOCKED) {
+    return containsBlockedBloomFilter(filter, filterSize, docid);
+  }
+  return containsBloomFilter(filter, filterSize, nbHash, docid);
+}
+
+/**
+ * Batched version of containsDocid: tests a sorted block of docids
+ * against a Bloom filter chain in a single pass. The chain is walked
+ * once, and all docids that fall into the same segment are tested
+ * against its filter together.
+ *
+ * @param pool Segment pool
+ * @param list Skip list of the chain, or NULL
+ * @param docids Sorted document ids
+ * @param count Number of document ids
+ * @param pointer Pointer to segment. It only moves forward, and is set
+ *        to UNDEFINED_POINTER once the chain has been exhausted.
+ * @param mask Bitmask with one bit per docid. On input, the docids to
+ *        test; on output, those that may exist in the chain.
+ * @return Number of docids that may exist in the chain
+ */
+int containsDocidBlock(SegmentPool* pool, SkipList* list, unsigned int* docids, int count,
+                       long* pointer, unsigned long* mask) {
+  int i = nextBitMask(mask, 0, count), matches = 0;
+  while(i < count) {
+    // Move to the segment that may contain docids[i]
+    *pointer = seekSegment(pool, list, *pointer, docids[i]);
+    if(*pointer == UNDEFINED_POINTER) {
+      // None of the remaining docids can be in the chain
+      for(; i < count && (i & 63); i++) {
+        CLEAR_BIT_MASK(mask, i);
+      }
+      for(; i < count; i += 64) {
+        mask[i >> 6] = 0;
+      }
+      break;
+    }
+    int pSegment = DECODE_SEGMENT(*pointer);
+    unsigned int pOffset = DECODE_OFFSET(*pointer);
+    // Docids in [i, end) all fall into this segment
+    unsigned int maxDocId = pool->pool[pSegment][pOffset + 3];
+    int end = i + 1;
+    while(end < count && LESS_THAN_EQUAL(docids[end], maxDocId, pool->reverse)) {
+      end++;
+    }
+    // Dense segments are tested exactly
+    unsigned int* block = (unsigned int*) &pool->pool[pSegment][pOffset + 7];
+    if(block[0] & BITMAP_CONTAINER_FLAG) {
+      matches += containsBitmapContainerBatch(block, docids, i, end, mask);
+      i = nextBitMask(mask, end, count);
+      continue;
+    }
+
+    // The last docid of a segment is stored in its header
+    int last = end - 1;
+    int lastIsMax = docids[last] == maxDocId && IS_SET_BIT_MASK(mask, last);
+
+    unsigned int filterSize, nbHash;
+    unsigned int* filter = getSegmentBloomFilter(pool, pSegment, pOffset,
+                                                 &filterSize, &nbHash);
+    if(pool->bloomEnabled == BLOOM_FILTER_BLOCKED) {
+      matches += containsBlockedBloomFilterBatch(filter, filterSize, docids, i, end, mask);
+    } else {
+      matches += containsBloomFilterBatch(filter, filterSize, nbHash, docids, i, end, mask);
+    }
+
+    if(lastIsMax && !IS_SET_BIT_MASK(mask, last)) {
+      SET_BIT_MASK(mask, last);
+      matches++;
+    }
+    i = nextBitMask(mask, end, count);
+  }
+  return matches;
 }
 
 /**
@@ -680,6 +1047,7 @@ long readPostingsForTerm(SegmentPool* pool, long pointer, FILE* fp) {
     int reqspace = 0;
     fread(&reqspace, sizeof(int), 1, fp);
 
+    alignSegmentPoolOffset(pool);
     if(reqspace > (MAX_INT_VALUE - pool->offset)) {
       pool->segment++;
       pool->offset = 0;
@@ -0,0 +1,195 @@
+#ifndef BITMAP_CONTAINER_H_GUARD
+#define BITMAP_CONTAINER_H_GUARD
+
+#include <string.h>
+#include "pfordelta/opt_p4.h"
+#include "bloom/BloomFilter.h"
+
+// Docid blocks with at least this many postings per docid in their
+// range are stored as bitmap containers (the Roaring threshold).
+#define BITMAP_CONTAINER_DENSITY 0.0625
+// Set in the first word of a docid block that is stored as a bitmap.
+// The first word of a PFOR block only uses its low 16 bits.
+#define BITMAP_CONTAINER_FLAG 0x80000000u
+// Number of ints in front of the bitmap words
+#define BITMAP_CONTAINER_HEADER 2
+
+/**
+ * A bitmap container covers a range of 32-docid words. Its layout is
+ *
+ *     [flag | number of words][first word][words ...]
+ *
+ * where docid d is bit (d & 31) of global word (d >> 5). Words are
+ * aligned to multiples of 32 docids, so that the words of two
+ * containers line up and can be ANDed directly.
+ */
+
+/**
+ * Number of ints a bitmap container takes to store docids
+ * in the range [first, last].
+ */
+unsigned int computeBitmapContainerLength(unsigned int first, unsigned int last) {
+  return (last >> 5) - (first >> 5) + 1 + BITMAP_CONTAINER_HEADER;
+}
+
+/**
+ * Writes docids into a bitmap container.
+ *
+ * @param data Sorted document ids (in either direction)
+ * @param len Number of document ids
+ * @param out Output container, of computeBitmapContainerLength ints
+ * @return Length of the container in number of ints
+ */
+unsigned int encodeBitmapContainer(unsigned int* data, unsigned int len, unsigned int* out) {
+  unsigned int first = data[0] < data[len - 1] ? data[0] : data[len - 1];
+  unsigned int last = data[0] < data[len - 1] ? data[len - 1] : data[0];
+  unsigned int size = computeBitmapContainerLength(first, last);
+  unsigned int firstWord = first >> 5;
+  out[0] = BITMAP_CONTAINER_FLAG | (size - BITMAP_CONTAINER_HEADER);
+  out[1] = firstWord;
+  memset(&out[BITMAP_CONTAINER_HEADER], 0,
+         (size - BITMAP_CONTAINER_HEADER) * sizeof(unsigned int));
+  int i;
+  for(i = 0; i < len; i++) {
+    out[BITMAP_CONTAINER_HEADER + (data[i] >> 5) - firstWord] |= 1u << (data[i] & 31);
+  }
+  return size;
+}
+
+/**
+ * Decodes a bitmap container into a docid block. Like a decoded PFOR
+ * block, the output is padded with zeros up to BLOCK_SIZE entries.
+ *
+ * @param block Bitmap container
+ * @param out Output buffer, at least BLOCK_SIZE ints long
+ * @param reverse Whether to output docids in decreasing order
+ * @return Number of docids
+ */
+int decodeBitmapContainer(unsigned int* block, unsigned int* out, int reverse) {
+  unsigned int nbWords = block[0] & ~BITMAP_CONTAINER_FLAG;
+  unsigned int base = block[1] << 5;
+  unsigned int* words = &block[BITMAP_CONTAINER_HEADER];
+  int i, n = 0;
+  if(!reverse) {
+    for(i = 0; i < nbWords; i++) {
+      unsigned int w = words[i];
+      while(w) {
+        out[n++] = base + (i << 5) + __builtin_ctz(w);
+        w &= w - 1;
+      }
+    }
+  } else {
+    for(i = nbWords - 1; i >= 0; i--) {
+      unsigned int w = words[i];
+      while(w) {
+        int bit = 31 - __builtin_clz(w);
+        out[n++] = base + (i << 5) + bit;
+        w ^= 1u << bit;
+      }
+    }
+  }
+  if(n < BLOCK_SIZE) {
+    memset(&out[n], 0, (BLOCK_SIZE - n) * sizeof(unsigned int));
+  }
+  return n;
+}
+
+/**
+ * Membership test on a bitmap container
+ */
+int containsBitmapContainer(unsigned int* block, unsigned int docid) {
+  unsigned int word = (docid >> 5) - block[1];
+  if((docid >> 5) < block[1] || word >= (block[0] & ~BITMAP_CONTAINER_FLAG)) {
+    return 0;
+  }
+  return (block[BITMAP_CONTAINER_HEADER + word] >> (docid & 31)) & 1;
+}
+
+/**
+ * Batched membership test on a bitmap container. Behaves like
+ * containsBlockedBloomFilterBatch, except that the answer is exact.
+ *
+ * @param block Bitmap container
+ * @param values Document ids
+ * @param begin Index of the first docid to test
+ * @param end Index past the last docid to test
+ * @param mask Bitmask with one bit per docid. On input, the docids to
+ *        test; on output, those that exist in the container.
+ * @return Number of docids in [begin, end) that exist in the container
+ */
+int containsBitmapContainerBatch(unsigned int* block, unsigned int* values,
+                                 int begin, int end, unsigned long* mask) {
+  int i, matches = 0;
+  for(i = nextBitMask(mask, begin, end); i < end; i = nextBitMask(mask, i + 1, end)) {
+    if(containsBitmapContainer(block, values[i])) {
+      matches++;
+    } else {
+      CLEAR_BIT_MASK(mask, i);
+    }
+  }
+  return matches;
+}
+
+/**
+ * Intersects two bitmap containers, word by word, over the docids
+ * between "from" and "to" (inclusive).
+ *
+ * @param a First bitmap container
+ * @param b Second bitmap container
+ * @param from First docid of the range, in output order
+ * @param to Last docid of the range, in output order
+ * @param reverse Whether to output docids in decreasing order
+ * @param out Output docids
+ * @param max Maximum number of docids to output
+ * @return Number of docids written to "out"
+ */
+int intersectBitmapContainers(unsigned int* a, unsigned int* b,
+                              unsigned int from, unsigned int to, int reverse,
+                              int* out, int max) {
+  unsigned int low = from < to ? from : to;
+  unsigned int high = from < to ? to : from;
+  unsigned int aEnd = a[1] + (a[0] & ~BITMAP_CONTAINER_FLAG);
+  unsigned int bEnd = b[1] + (b[0] & ~BITMAP_CONTAINER_FLAG);
+
+  // Global words shared by both containers and the range
+  unsigned int first = low >> 5, end = (high >> 5) + 1;
+  if(a[1] > first) first = a[1];
+  if(b[1] > first) first = b[1];
+  if(aEnd < end) end = aEnd;
+  if(bEnd < end) end = bEnd;
+  if(first >= end) {
+    return 0;
+  }
+
+  unsigned int* aWords = &a[BITMAP_CONTAINER_HEADER];
+  unsigned int* bWords = &b[BITMAP_CONTAINER_HEADER];
+  unsigned int lowMask = ~0u << (low & 31);
+  unsigned int highMask = ~0u >> (31 - (high & 31));
+  unsigned int word;
+  int n = 0;
+  if(!reverse) {
+    for(word = first; word < end && n < max; word++) {
+      unsigned int w = aWords[word - a[1]] & bWords[word - b[1]];
+      if(word == (low >> 5)) w &= lowMask;
+      if(word == (high >> 5)) w &= highMask;
+      while(w && n < max) {
+        out[n++] = (word << 5) + __builtin_ctz(w);
+        w &= w - 1;
+      }
+    }
+  } else {
+    for(word = end; word-- > first && n < max;) {
+      unsigned int w = aWords[word - a[1]] & bWords[word - b[1]];
+      if(word == (low >> 5)) w &= lowMask;
+      if(word == (high >> 5)) w &= highMask;
+      while(w && n < max) {
+        int bit = 31 - __builtin_clz(w);
+        out[n++] = (word << 5) + bit;
+        w ^= 1u << bit;
+      }
+    }
+  }
+  return n;
+}
+
+#endif
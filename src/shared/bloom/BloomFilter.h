@@ -3,6 +3,9 @@
 
 #include <math.h>
 #include <stdlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define BLOOM_FILTER_UNIT_SIZE (sizeof(unsigned int) * 8)
 #define BLOOM_FILTER_UNIT_SIZE_1 (unsigned int) (BLOOM_FILTER_UNIT_SIZE - 1)
@@ -10,6 +13,42 @@
 #define BLOOM_FILTER_ONE (unsigned int) 1
 #define DEFAULT_HASH_SEED (unsigned int) 0x7ed55d16
 
+// Kinds of Bloom filter chains, as recorded in the segment pool header.
+// Indexes built before blocked filters existed store any positive
+// value for classic filters.
+#define BLOOM_FILTER_CLASSIC 1
+#define BLOOM_FILTER_BLOCKED -1
+
+// Number of hash functions recorded in the pool header when filters
+// are sized per term, and each classic filter stores its own
+#define ADAPTIVE_NB_HASH 0
+// Lists with at least this many postings get the target false positive
+// rate. Shorter lists are probed less often, and their rate is relaxed
+// in proportion, up to ADAPTIVE_BLOOM_FILTER_MAX_FPR.
+#define ADAPTIVE_BLOOM_FILTER_REFERENCE_DF 4096
+#define ADAPTIVE_BLOOM_FILTER_MAX_FPR 0.2
+
+// A blocked Bloom filter is an array of 256-bit blocks. A value
+// selects one block and sets one bit in each of its 8 words,
+// so a membership test touches a single cache line.
+#define BLOCKED_BLOOM_FILTER_WORDS 8
+#define BLOCKED_BLOOM_FILTER_BITS (BLOCKED_BLOOM_FILTER_WORDS * BLOOM_FILTER_UNIT_SIZE)
+#define BLOCKED_BLOOM_FILTER_ALIGNMENT (BLOCKED_BLOOM_FILTER_WORDS * sizeof(unsigned int))
+#define BLOCKED_BLOOM_FILTER_MULTIPLIER 0x9e3779b97f4a7c15ul
+// Maximum number of values tested in one batch
+#define BLOOM_FILTER_BATCH_SIZE 256
+// Number of words in a bitmask over one batch
+#define BLOOM_FILTER_MASK_WORDS (BLOOM_FILTER_BATCH_SIZE / 64)
+#define IS_SET_BIT_MASK(mask, i) (((mask)[(i) >> 6] >> ((i) & 63)) & 1)
+#define SET_BIT_MASK(mask, i) ((mask)[(i) >> 6] |= 1ul << ((i) & 63))
+#define CLEAR_BIT_MASK(mask, i) ((mask)[(i) >> 6] &= ~(1ul << ((i) & 63)))
+
+// Odd multipliers used to pick a bit within each word of a block
+const unsigned int BLOCKED_BLOOM_FILTER_SALT[BLOCKED_BLOOM_FILTER_WORDS] = {
+  0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+  0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31
+};
+
 // Jenkin's integer hash function
 unsigned int hash(unsigned int a, unsigned int seed) {
   a = (a+seed) + (a<<12);
@@ -20,6 +59,31 @@ unsigned int hash(unsigned int a, unsigned int seed) {
   return (a^0xb55a4f09) ^ (a>>16);
 }
 
+/**
+ * Finds the next bit set in a batch bitmask.
+ *
+ * @param mask Bitmask
+ * @param i Index to start from
+ * @param end Index past the last bit to look at
+ * @return Index of the first bit set in [i, end), or "end" if there is none
+ */
+int nextBitMask(unsigned long* mask, int i, int end) {
+  if(i >= end) {
+    return end;
+  }
+  int word = i >> 6;
+  unsigned long bits = mask[word] & (~0ul << (i & 63));
+  while(!bits) {
+    word++;
+    if((word << 6) >= end) {
+      return end;
+    }
+    bits = mask[word];
+  }
+  i = (word << 6) + __builtin_ctzl(bits);
+  return i < end ? i : end;
+}
+
 /**
  * Given the number of documents and bits per element parameter,
  * calculate the length of the Bloom filter
@@ -39,6 +103,43 @@ int computeBloomFilterLength(unsigned int df, int bitsPerElement) {
   return length;
 }
 
+/**
+ * Chooses the false positive rate of a term's filters from the target
+ * rate of the index and the document frequency of the term.
+ *
+ * @param targetFpr Target false positive rate
+ * @param df Document frequency of the term
+ * @return False positive rate for the term
+ */
+float computeTermFalsePositiveRate(float targetFpr, unsigned int df) {
+  float fpr = targetFpr;
+  if(df > 0 && df < ADAPTIVE_BLOOM_FILTER_REFERENCE_DF) {
+    fpr = targetFpr * ADAPTIVE_BLOOM_FILTER_REFERENCE_DF / df;
+  }
+  if(fpr > ADAPTIVE_BLOOM_FILTER_MAX_FPR) {
+    fpr = ADAPTIVE_BLOOM_FILTER_MAX_FPR;
+  }
+  return fpr;
+}
+
+/**
+ * Number of bits per element that an optimally configured Bloom filter
+ * needs to reach a false positive rate: -ln(fpr) / ln(2)^2
+ */
+int computeBitsPerElement(float fpr) {
+  int bitsPerElement = (int) ceil(-log(fpr) / (M_LN2 * M_LN2));
+  return bitsPerElement < 1 ? 1 : bitsPerElement;
+}
+
+/**
+ * Optimal number of hash functions for a number of bits per element:
+ * bitsPerElement * ln(2)
+ */
+int computeNbHash(int bitsPerElement) {
+  int nbHash = (int) (bitsPerElement * M_LN2 + 0.5);
+  return nbHash < 1 ? 1 : nbHash;
+}
+
 /**
  * Insert a document id into the Bloom filter
  *
@@ -82,4 +183,294 @@ int containsBloomFilter(unsigned int* filter, unsigned int filterSize,
   return 1;
 }
 
+/**
+ * Given the number of documents and bits per element parameter,
+ * calculate the length of a blocked Bloom filter
+ *
+ * @param df Document frequency
+ * @param bitsPerElement Number of bits per element
+ * @return length of Bloom vector in number of ints (a multiple of 8)
+ */
+int computeBlockedBloomFilterLength(unsigned int df, int bitsPerElement) {
+  unsigned int nbBlocks = (df * bitsPerElement + BLOCKED_BLOOM_FILTER_BITS - 1) /
+    BLOCKED_BLOOM_FILTER_BITS;
+  if(nbBlocks == 0) {
+    nbBlocks = 1;
+  }
+  return nbBlocks * BLOCKED_BLOOM_FILTER_WORDS;
+}
+
+/**
+ * Multiply-shift hash of a value. The high half picks the block
+ * (without a modulo), and the low half feeds the per-word bit selection.
+ */
+unsigned long blockedBloomFilterHash(unsigned int value) {
+  return value * BLOCKED_BLOOM_FILTER_MULTIPLIER;
+}
+
+/**
+ * Offset (in ints) of the block that hash "h" maps to
+ */
+unsigned int blockedBloomFilterOffset(unsigned int filterSize, unsigned long h) {
+  unsigned long nbBlocks = filterSize / BLOCKED_BLOOM_FILTER_WORDS;
+  return ((h >> 32) * nbBlocks >> 32) * BLOCKED_BLOOM_FILTER_WORDS;
+}
+
+unsigned int* blockedBloomFilterBlock(unsigned int* filter, unsigned int filterSize,
+                                      unsigned long h) {
+  return &filter[blockedBloomFilterOffset(filterSize, h)];
+}
+
+/**
+ * Insert a document id into a blocked Bloom filter
+ *
+ * @param filter Bloom filter
+ * @param filterSize Size of the filter in number of ints
+ * @param value Document id
+ */
+void insertIntoBlockedBloomFilter(unsigned int* filter, unsigned int filterSize,
+                                  unsigned int value) {
+  unsigned long h = blockedBloomFilterHash(value);
+  unsigned int* block = blockedBloomFilterBlock(filter, filterSize, h);
+  unsigned int key = (unsigned int) h;
+  int i;
+  for(i = 0; i < BLOCKED_BLOOM_FILTER_WORDS; i++) {
+    block[i] |= BLOOM_FILTER_ONE << ((key * BLOCKED_BLOOM_FILTER_SALT[i]) >> 27);
+  }
+}
+
+/**
+ * Computes, for "n" values at once, the offset (in ints) of the block
+ * each value maps to, and the key that selects its bits in that block.
+ *
+ * @param values Values to hash
+ * @param n Number of values
+ * @param filterSize Size of the filter in number of ints
+ * @param offsets Receives the block offsets
+ * @param keys Receives the keys
+ */
+void hashBlockedBloomFilterScalar(unsigned int* values, int n, unsigned int filterSize,
+                                  unsigned int* offsets, unsigned int* keys) {
+  int i;
+  for(i = 0; i < n; i++) {
+    unsigned long h = blockedBloomFilterHash(values[i]);
+    offsets[i] = blockedBloomFilterOffset(filterSize, h);
+    keys[i] = (unsigned int) h;
+  }
+}
+
+int testBlockedBloomFilterScalar(unsigned int* block, unsigned int key) {
+  int i;
+  for(i = 0; i < BLOCKED_BLOOM_FILTER_WORDS; i++) {
+    if(!((block[i] >> ((key * BLOCKED_BLOOM_FILTER_SALT[i]) >> 27)) & 1)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int containsBlockedBloomFilterScalar(unsigned int* filter, unsigned int filterSize,
+                                     unsigned int value) {
+  unsigned long h = blockedBloomFilterHash(value);
+  return testBlockedBloomFilterScalar(blockedBloomFilterBlock(filter, filterSize, h),
+                                      (unsigned int) h);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * AVX2 version of hashBlockedBloomFilterScalar. The 64-bit products are
+ * assembled from 32x32-bit multiplies, four values at a time.
+ */
+__attribute__((target("avx2")))
+void hashBlockedBloomFilterAVX2(unsigned int* values, int n, unsigned int filterSize,
+                                unsigned int* offsets, unsigned int* keys) {
+  __m256i low = _mm256_set1_epi64x(BLOCKED_BLOOM_FILTER_MULTIPLIER & 0xFFFFFFFF);
+  __m256i high = _mm256_set1_epi64x(BLOCKED_BLOOM_FILTER_MULTIPLIER >> 32);
+  __m256i nbBlocks = _mm256_set1_epi64x(filterSize / BLOCKED_BLOOM_FILTER_WORDS);
+  __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+  int i;
+  for(i = 0; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i*) &values[i]));
+    __m256i h = _mm256_add_epi64(_mm256_mul_epu32(v, low),
+                                 _mm256_slli_epi64(_mm256_mul_epu32(v, high), 32));
+    __m256i block = _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(h, 32),
+                                                       nbBlocks), 32);
+    // Block index times BLOCKED_BLOOM_FILTER_WORDS
+    block = _mm256_slli_epi64(block, 3);
+    _mm_storeu_si128((__m128i*) &offsets[i],
+                     _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(block, pack)));
+    _mm_storeu_si128((__m128i*) &keys[i],
+                     _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(h, pack)));
+  }
+  hashBlockedBloomFilterScalar(&values[i], n - i, filterSize, &offsets[i], &keys[i]);
+}
+
+/**
+ * AVX2 membership test: computes all 8 bit positions at once and
+ * tests them against the block with a single vptest.
+ */
+__attribute__((target("avx2")))
+int testBlockedBloomFilterAVX2(unsigned int* block, unsigned int key) {
+  __m256i salt = _mm256_loadu_si256((__m256i*) BLOCKED_BLOOM_FILTER_SALT);
+  __m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(key), salt), 27);
+  __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
+  return _mm256_testc_si256(_mm256_loadu_si256((__m256i*) block), mask);
+}
+
+__attribute__((target("avx2")))
+int containsBlockedBloomFilterAVX2(unsigned int* filter, unsigned int filterSize,
+                                   unsigned int value) {
+  unsigned long h = blockedBloomFilterHash(value);
+  return testBlockedBloomFilterAVX2(blockedBloomFilterBlock(filter, filterSize, h),
+                                    (unsigned int) h);
+}
+#endif
+
+/**
+ * Perform a membership test on a blocked Bloom filter, using AVX2
+ * if the CPU supports it.
+ */
+int containsBlockedBloomFilter(unsigned int* filter, unsigned int filterSize,
+                               unsigned int value) {
+#if defined(__x86_64__) || defined(__i386__)
+  if(__builtin_cpu_supports("avx2")) {
+    return containsBlockedBloomFilterAVX2(filter, filterSize, value);
+  }
+#endif
+  return containsBlockedBloomFilterScalar(filter, filterSize, value);
+}
+
+/**
+ * Collects the values whose bit is set in "mask" within [begin, end).
+ *
+ * @param values Values
+ * @param begin Index of the first value
+ * @param end Index past the last value
+ * @param mask Bitmask with one bit per value
+ * @param tested Output: the selected values
+ * @param index Output: index of each selected value
+ * @return Number of selected values
+ */
+int gatherBloomFilterBatch(unsigned int* values, int begin, int end, unsigned long* mask,
+                           unsigned int* tested, unsigned int* index) {
+  int n = 0, word;
+  for(word = begin >> 6; (word << 6) < end; word++) {
+    unsigned long bits = mask[word];
+    if((word << 6) < begin) {
+      bits &= ~0ul << (begin & 63);
+    }
+    if(((word + 1) << 6) > end) {
+      bits &= (1ul << (end & 63)) - 1;
+    }
+    while(bits) {
+      int i = (word << 6) + __builtin_ctzl(bits);
+      bits &= bits - 1;
+      index[n] = i;
+      tested[n++] = values[i];
+    }
+  }
+  return n;
+}
+
+int containsBlockedBloomFilterBatchScalar(unsigned int* filter, unsigned int filterSize,
+                                          unsigned int* values, int begin, int end,
+                                          unsigned long* mask) {
+  unsigned int tested[BLOOM_FILTER_BATCH_SIZE], index[BLOOM_FILTER_BATCH_SIZE];
+  unsigned int offsets[BLOOM_FILTER_BATCH_SIZE], keys[BLOOM_FILTER_BATCH_SIZE];
+  int n = gatherBloomFilterBatch(values, begin, end, mask, tested, index);
+  int i, matches = 0;
+  hashBlockedBloomFilterScalar(tested, n, filterSize, offsets, keys);
+  for(i = 0; i < n; i++) {
+    __builtin_prefetch(&filter[offsets[i]]);
+  }
+  for(i = 0; i < n; i++) {
+    if(testBlockedBloomFilterScalar(&filter[offsets[i]], keys[i])) {
+      matches++;
+    } else {
+      CLEAR_BIT_MASK(mask, index[i]);
+    }
+  }
+  return matches;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+int containsBlockedBloomFilterBatchAVX2(unsigned int* filter, unsigned int filterSize,
+                                        unsigned int* values, int begin, int end,
+                                        unsigned long* mask) {
+  unsigned int tested[BLOOM_FILTER_BATCH_SIZE], index[BLOOM_FILTER_BATCH_SIZE];
+  unsigned int offsets[BLOOM_FILTER_BATCH_SIZE], keys[BLOOM_FILTER_BATCH_SIZE];
+  int n = gatherBloomFilterBatch(values, begin, end, mask, tested, index);
+  int i, matches = 0;
+  hashBlockedBloomFilterAVX2(tested, n, filterSize, offsets, keys);
+  for(i = 0; i < n; i++) {
+    __builtin_prefetch(&filter[offsets[i]]);
+  }
+  for(i = 0; i < n; i++) {
+    if(testBlockedBloomFilterAVX2(&filter[offsets[i]], keys[i])) {
+      matches++;
+    } else {
+      CLEAR_BIT_MASK(mask, index[i]);
+    }
+  }
+  return matches;
+}
+#endif
+
+/**
+ * Batched membership test on a blocked Bloom filter: tests values[i]
+ * for every i in [begin, end) whose bit is set in "mask," and clears
+ * the bit if the value is not in the filter. All values are hashed
+ * first, and their blocks prefetched, before any of them is tested.
+ *
+ * @param filter Bloom filter
+ * @param filterSize Size of the filter in number of ints
+ * @param values Values to test
+ * @param begin Index of the first value to test
+ * @param end Index past the last value to test
+ *        (end - begin must not exceed BLOOM_FILTER_BATCH_SIZE)
+ * @param mask Bitmask with one bit per value
+ * @return Number of tested values that may exist in the filter
+ */
+int containsBlockedBloomFilterBatch(unsigned int* filter, unsigned int filterSize,
+                                    unsigned int* values, int begin, int end,
+                                    unsigned long* mask) {
+#if defined(__x86_64__) || defined(__i386__)
+  if(__builtin_cpu_supports("avx2")) {
+    return containsBlockedBloomFilterBatchAVX2(filter, filterSize, values, begin, end, mask);
+  }
+#endif
+  return containsBlockedBloomFilterBatchScalar(filter, filterSize, values, begin, end, mask);
+}
+
+/**
+ * Batched membership test on a Bloom filter. Behaves like
+ * containsBlockedBloomFilterBatch.
+ *
+ * @param filter Bloom filter
+ * @param filterSize Size of the filter in number of ints
+ * @param nbHash Number of hash functions
+ * @param values Values to test
+ * @param begin Index of the first value to test
+ * @param end Index past the last value to test
+ *        (end - begin must not exceed BLOOM_FILTER_BATCH_SIZE)
+ * @param mask Bitmask with one bit per value
+ * @return Number of tested values that may exist in the filter
+ */
+int containsBloomFilterBatch(unsigned int* filter, unsigned int filterSize, int nbHash,
+                             unsigned int* values, int begin, int end,
+                             unsigned long* mask) {
+  unsigned int tested[BLOOM_FILTER_BATCH_SIZE], index[BLOOM_FILTER_BATCH_SIZE];
+  int n = gatherBloomFilterBatch(values, begin, end, mask, tested, index);
+  int i, matches = 0;
+  for(i = 0; i < n; i++) {
+    if(containsBloomFilter(filter, filterSize, nbHash, tested[i])) {
+      matches++;
+    } else {
+      CLEAR_BIT_MASK(mask, index[i]);
+    }
+  }
+  return matches;
+}
+
 #endif
@@ -0,0 +1,341 @@
+/**
+ * Extracts the features of the candidate documents of a query, in
+ * batch. The query terms are looked up in document vectors through a
+ * small hash table, decoding buffers are allocated once per batch, and
+ * candidates are spread across threads, each with its own query
+ * context, position buffers and window counts.
+ *
+ * In a positional index, positions are read from the postings of the
+ * query terms instead of document vectors. Candidates are then visited
+ * in docid order, and every thread walks its own cursors over a
+ * contiguous range of docids.
+ *
+ * If every feature only needs term frequencies, and the index has a
+ * forward index, term frequencies are looked up there instead, and no
+ * positions are decoded at all.
+ *
+ *   FeatureExtractor* extractor =
+ *     createFeatureExtractor(index, extractors, scorers, numberOfFeatures,
+ *                            windowCounts, staticFeatures,
+ *                            numberOfStaticFeatures, numberOfThreads);
+ *   for(each query) {
+ *     int n = extractFeatures(extractor, query, qlength, set, hits,
+ *                             features, context);
+ *   }
+ *   destroyFeatureExtractor(extractor);
+ */
+
+#ifndef FEATURE_EXTRACTOR_H_GUARD
+#define FEATURE_EXTRACTOR_H_GUARD
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "InvertedIndex.h"
+#include "PostingsList.h"
+#include "DocumentVector.h"
+#include "ForwardIndex.h"
+#include "QueryContext.h"
+#include "scorer/ScoringFunction.h"
+#include "feature/WindowCounts.h"
+#include "feature/TermFeature.h"
+
+/**
+ * Pointers to feature computation functions.
+ *
+ * @param positions List of positions for every query term
+ * @param query List of query terms
+ * @param qlength Number of query terms
+ * @param docid Document id of the document to extract features for
+ * @param pointers Dictionary Pointers
+ * @param scorer Scoring function
+ * @param counts Window counts of the document, shared by all features
+ * @param context Query context to draw temporary buffers from
+ */
+typedef float (*computeFeature)(int** positions, int* query, int qlength, int docid,
+                                Pointers* pointers, ScoringFunction* scorer,
+                                WindowCounts* counts, QueryContext* context);
+
+/**
+ * Whether a feature only reads the number of positions of each query
+ * term, i.e., its term frequency.
+ */
+int isTermFrequencyFeature(computeFeature extractor) {
+  return extractor == computeTermFeature;
+}
+
+typedef struct FeatureExtractor FeatureExtractor;
+
+struct FeatureExtractor {
+  InvertedIndex* index;
+  // Features computed from positions, and the scoring function of each
+  computeFeature* extractors;
+  ScoringFunction* scorers;
+  int numberOfFeatures;
+  // Whether features only read the number of positions of each query
+  // term (positions[i][0]), and not the positions themselves
+  int termFrequenciesOnly;
+  // Query independent features, indexed by docid
+  float** staticFeatures;
+  int numberOfStaticFeatures;
+
+  // State of each thread
+  int numberOfThreads;
+  QueryContext** contexts;
+  WindowCounts** windowCounts;
+};
+
+/**
+ * Creates a feature extractor. Extractors, scorers, and static features
+ * are not copied, and must outlive the extractor.
+ *
+ * @param index Inverted index, with document vectors or positions
+ * @param extractors Feature computation functions
+ * @param scorers Scoring function of each feature
+ * @param numberOfFeatures Number of features computed from positions
+ * @param windowCounts Gaps and windows used by the features
+ * @param staticFeatures Query independent features
+ * @param numberOfStaticFeatures Number of static features
+ * @param numberOfThreads Number of threads to extract features with
+ */
+FeatureExtractor* createFeatureExtractor(InvertedIndex* index, computeFeature* extractors,
+                                         ScoringFunction* scorers, int numberOfFeatures,
+                                         WindowCounts* windowCounts, float** staticFeatures,
+                                         int numberOfStaticFeatures, int numberOfThreads) {
+  FeatureExtractor* extractor = (FeatureExtractor*) malloc(sizeof(FeatureExtractor));
+  extractor->index = index;
+  extractor->extractors = extractors;
+  extractor->scorers = scorers;
+  extractor->numberOfFeatures = numberOfFeatures;
+  extractor->termFrequenciesOnly = 1;
+  int f;
+  for(f = 0; f < numberOfFeatures; f++) {
+    if(!isTermFrequencyFeature(extractors[f])) {
+      extractor->termFrequenciesOnly = 0;
+    }
+  }
+  extractor->staticFeatures = staticFeatures;
+  extractor->numberOfStaticFeatures = numberOfStaticFeatures;
+  extractor->numberOfThreads = numberOfThreads < 1 ? 1 : numberOfThreads;
+  extractor->contexts = (QueryContext**)
+    malloc(extractor->numberOfThreads * sizeof(QueryContext*));
+  extractor->windowCounts = (WindowCounts**)
+    malloc(extractor->numberOfThreads * sizeof(WindowCounts*));
+  int t;
+  for(t = 0; t < extractor->numberOfThreads; t++) {
+    extractor->contexts[t] = createQueryContext(DEFAULT_CONTEXT_SIZE);
+    extractor->windowCounts[t] = copyWindowCounts(windowCounts);
+  }
+  return extractor;
+}
+
+void destroyFeatureExtractor(FeatureExtractor* extractor) {
+  int t;
+  for(t = 0; t < extractor->numberOfThreads; t++) {
+    destroyQueryContext(extractor->contexts[t]);
+    destroyWindowCounts(extractor->windowCounts[t]);
+  }
+  free(extractor->contexts);
+  free(extractor->windowCounts);
+  free(extractor);
+}
+
+/**
+ * Whether term frequencies are read from the forward index, rather than
+ * counted from positions.
+ */
+int readsForwardIndex(FeatureExtractor* extractor) {
+  return extractor->termFrequenciesOnly && extractor->index->forward;
+}
+
+/**
+ * Whether the index holds what the features need: positions, either in
+ * document vectors or in postings, or term frequencies only.
+ */
+int canExtractFeatures(FeatureExtractor* extractor) {
+  return extractor->index->vectors || isPositional(extractor->index->pool) ||
+    readsForwardIndex(extractor);
+}
+
+/**
+ * Compares two (docid << 32 | index) keys, to sort documents by docid.
+ */
+int compareDocidKeys(const void* a, const void* b) {
+  unsigned long x = *(const unsigned long*) a, y = *(const unsigned long*) b;
+  return x < y ? -1 : x > y;
+}
+
+typedef struct FeatureExtractionTask FeatureExtractionTask;
+
+// The share of a batch extracted by one thread: the candidates
+// set[order[from]], ..., set[order[to - 1]]
+struct FeatureExtractionTask {
+  FeatureExtractor* extractor;
+  int thread;
+  int* query;
+  int qlength;
+  QueryTermTable* table;
+  int* set;
+  int* order;
+  int from;
+  int to;
+  float* features;
+};
+
+void* runFeatureExtractionTask(void* argument) {
+  FeatureExtractionTask* task = (FeatureExtractionTask*) argument;
+  FeatureExtractor* extractor = task->extractor;
+  InvertedIndex* index = extractor->index;
+  QueryContext* context = extractor->contexts[task->thread];
+  WindowCounts* counts = extractor->windowCounts[task->thread];
+  int qlength = task->qlength;
+  int totalFeatures = extractor->numberOfFeatures + extractor->numberOfStaticFeatures;
+  resetQueryContext(context);
+
+  FixedBuffer** buffers = getBuffersQueryContext(context, qlength);
+  int** positions = (int**) allocateQueryContext(context, qlength * sizeof(int*));
+  Cursor** cursors = NULL;
+  int* frequencies = NULL;
+  unsigned int* block = NULL;
+  unsigned int* aux = NULL;
+  int f, k;
+  if(readsForwardIndex(extractor)) {
+    // positions[f][0] is the term frequency, and nothing follows
+    frequencies = (int*) allocateQueryContext(context, qlength * sizeof(int));
+    for(f = 0; f < qlength; f++) {
+      positions[f] = &frequencies[f];
+    }
+    block = (unsigned int*) allocateQueryContext(context, BLOCK_SIZE * 4 * sizeof(int));
+    aux = (unsigned int*) allocateQueryContext(context, BLOCK_SIZE * 4 * sizeof(int));
+  } else if(isPositional(index->pool)) {
+    cursors = (Cursor**) allocateQueryContext(context, qlength * sizeof(Cursor*));
+    for(f = 0; f < qlength; f++) {
+      cursors[f] = createCursor(index->pool,
+                                getHeadPointer(index->pointers, task->query[f]),
+                                getDf(index->pointers, task->query[f]), context);
+    }
+  } else {
+    block = (unsigned int*) allocateQueryContext(context, BLOCK_SIZE * 2 * sizeof(int));
+    aux = (unsigned int*) allocateQueryContext(context, BLOCK_SIZE * 4 * sizeof(int));
+  }
+
+  for(k = task->from; k < task->to; k++) {
+    int i = task->order[k];
+    int docid = task->set[i];
+    // Generate positions for query terms
+    if(frequencies) {
+      getTermFrequencies(index->forward, docid, task->query, qlength, frequencies,
+                         block, aux);
+    } else {
+      if(cursors) {
+        getPositionsAsBuffersCursor(cursors, qlength, docid, buffers);
+      } else {
+        getPositionsAsBuffers(index->vectors, docid, index->pointers->docLen->counter[docid],
+                              task->table, qlength, buffers, block, aux);
+      }
+      for(f = 0; f < qlength; f++) {
+        positions[f] = buffers[f]->buffer;
+      }
+      // Count the window matches of all features at once
+      computeWindowCounts(counts, positions, qlength);
+    }
+
+    // Compute feature values using the positions and counts
+    float* features = &task->features[i * totalFeatures];
+    for(f = 0; f < extractor->numberOfFeatures; f++) {
+      features[f] = extractor->extractors[f](positions, task->query, qlength, docid,
+                                             index->pointers, &extractor->scorers[f],
+                                             counts, context);
+    }
+    // Extract static features
+    for(f = 0; f < extractor->numberOfStaticFeatures; f++) {
+      features[extractor->numberOfFeatures + f] = extractor->staticFeatures[f][docid];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Extracts the features of the candidates of a query. Features of
+ * set[i] are written to features[i * totalFeatures], where totalFeatures
+ * counts both regular and static features.
+ *
+ * @param extractor Feature extractor
+ * @param query Query terms
+ * @param qlength Number of query terms
+ * @param set Candidate docids, terminated by a non-positive docid if
+ *        there are fewer than "hits"
+ * @param hits Maximum number of candidates
+ * @param features Output feature values
+ * @param context Query context to draw temporary buffers from
+ * @return Number of candidates
+ */
+int extractFeatures(FeatureExtractor* extractor, int* query, int qlength, int* set,
+                    int hits, float* features, QueryContext* context) {
+  InvertedIndex* index = extractor->index;
+  int numberOfDocuments = 0;
+  while(numberOfDocuments < hits && set[numberOfDocuments] > 0) {
+    numberOfDocuments++;
+  }
+
+  // Cursors only move forward, so candidates are visited in docid order
+  // when positions are read from postings
+  int* order = (int*) allocateQueryContext(context, numberOfDocuments * sizeof(int));
+  QueryTermTable* table = NULL;
+  int i;
+  if(isPositional(index->pool) && !readsForwardIndex(extractor)) {
+    unsigned long* keys = (unsigned long*)
+      allocateQueryContext(context, numberOfDocuments * sizeof(unsigned long));
+    for(i = 0; i < numberOfDocuments; i++) {
+      keys[i] = ((unsigned long) set[i] << 32) | i;
+    }
+    qsort(keys, numberOfDocuments, sizeof(unsigned long), compareDocidKeys);
+    for(i = 0; i < numberOfDocuments; i++) {
+      order[index->pool->reverse ? numberOfDocuments - 1 - i : i] = keys[i] & 0xFFFFFFFF;
+    }
+  } else {
+    for(i = 0; i < numberOfDocuments; i++) {
+      order[i] = i;
+    }
+    if(!readsForwardIndex(extractor)) {
+      table = createQueryTermTable(query, qlength, context);
+    }
+  }
+
+  // Threads are only worth starting for a few documents each
+  int numberOfThreads = extractor->numberOfThreads;
+  if(numberOfThreads > (numberOfDocuments + 15) / 16) {
+    numberOfThreads = (numberOfDocuments + 15) / 16;
+  }
+  if(numberOfThreads < 1) {
+    numberOfThreads = 1;
+  }
+  FeatureExtractionTask* tasks = (FeatureExtractionTask*)
+    allocateQueryContext(context, numberOfThreads * sizeof(FeatureExtractionTask));
+  pthread_t* threads = (pthread_t*)
+    allocateQueryContext(context, numberOfThreads * sizeof(pthread_t));
+  int t;
+  for(t = 0; t < numberOfThreads; t++) {
+    tasks[t].extractor = extractor;
+    tasks[t].thread = t;
+    tasks[t].query = query;
+    tasks[t].qlength = qlength;
+    tasks[t].table = table;
+    tasks[t].set = set;
+    tasks[t].order = order;
+    tasks[t].from = (long) numberOfDocuments * t / numberOfThreads;
+    tasks[t].to = (long) numberOfDocuments * (t + 1) / numberOfThreads;
+    tasks[t].features = features;
+  }
+
+  // The calling thread takes the first share
+  for(t = 1; t < numberOfThreads; t++) {
+    pthread_create(&threads[t], NULL, runFeatureExtractionTask, &tasks[t]);
+  }
+  runFeatureExtractionTask(&tasks[0]);
+  for(t = 1; t < numberOfThreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  return numberOfDocuments;
+}
+
+#endif
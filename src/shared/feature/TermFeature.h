@@ -2,9 +2,12 @@
 #define TERM_FEATURE_H_GUARD
 
 #include "scorer/ScoringFunction.h"
+#include "QueryContext.h"
+#include "feature/WindowCounts.h"
 
 float computeTermFeature(int** positions, int* query, int qlength, int docid,
-                         Pointers* pointers, ScoringFunction* scorer) {
+                         Pointers* pointers, ScoringFunction* scorer,
+                         WindowCounts* counts, QueryContext* context) {
   float score = 0;
   int i;
   for(i = 0; i < qlength; i++) {
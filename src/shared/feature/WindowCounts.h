@@ -0,0 +1,215 @@
+/**
+ * Window counts shared by the ordered (OD) and unordered (UW) window
+ * features. A feature file usually asks for the same pairs of adjacent
+ * query terms under several gaps and windows, and under several scoring
+ * functions. Rather than counting matches once per feature, the distinct
+ * gaps and windows are registered up front, and the counts for all of
+ * them are computed in a single merge of each pair of position lists.
+ *
+ * For adjacent query terms t_i and t_{i+1}, with positions p and pn:
+ *
+ *  - OD, gap g: number of positions p[j] for which the first position of
+ *    pn after p[j] is at most g + 1 positions away.
+ *  - UW, window w: for every p[j], one if the first position of pn after
+ *    p[j] is at most w - 1 positions away, plus the number of positions
+ *    of pn before p[j] (but after p[j - 1]) that are at most w - 1
+ *    positions away.
+ *
+ * Usage:
+ *
+ *   WindowCounts* counts = createWindowCounts();
+ *   addOrderedWindowCounts(counts, gap);
+ *   addUnorderedWindowCounts(counts, window);
+ *   ...
+ *   computeWindowCounts(counts, positions, qlength);   // per document
+ *   int* tf = getOrderedWindowCounts(counts, gap);     // one per term pair
+ */
+
+#ifndef WINDOW_COUNTS_H_GUARD
+#define WINDOW_COUNTS_H_GUARD
+
+#include <stdlib.h>
+
+typedef struct WindowCounts WindowCounts;
+
+struct WindowCounts {
+  // Distinct gaps (OD) and windows (UW), in increasing order
+  int* gaps;
+  int numberOfGaps;
+  int* windows;
+  int numberOfWindows;
+
+  // Counts of the current document: od[g * pairs + i] is the count of
+  // the i-th pair of terms under gaps[g], and likewise for uw
+  int* od;
+  int* uw;
+  int pairs;
+  int capacity;
+
+  // Number of matches whose smallest qualifying gap (window) is
+  // gaps[g] (windows[w]); the last bucket holds those that qualify
+  // under none
+  int* odHistogram;
+  int* uwHistogram;
+};
+
+WindowCounts* createWindowCounts() {
+  WindowCounts* counts = (WindowCounts*) calloc(1, sizeof(WindowCounts));
+  counts->odHistogram = (int*) calloc(1, sizeof(int));
+  counts->uwHistogram = (int*) calloc(1, sizeof(int));
+  return counts;
+}
+
+void destroyWindowCounts(WindowCounts* counts) {
+  if(counts->gaps) free(counts->gaps);
+  if(counts->windows) free(counts->windows);
+  if(counts->od) free(counts->od);
+  if(counts->uw) free(counts->uw);
+  free(counts->odHistogram);
+  free(counts->uwHistogram);
+  free(counts);
+}
+
+/**
+ * Inserts "value" into a sorted set, unless it is already there.
+ *
+ * @return The new size of the set
+ */
+int insertWindowSize(int** set, int length, int value) {
+  int i, j;
+  for(i = 0; i < length && (*set)[i] < value; i++);
+  if(i < length && (*set)[i] == value) {
+    return length;
+  }
+  *set = (int*) realloc(*set, (length + 1) * sizeof(int));
+  for(j = length; j > i; j--) {
+    (*set)[j] = (*set)[j - 1];
+  }
+  (*set)[i] = value;
+  return length + 1;
+}
+
+void addOrderedWindowCounts(WindowCounts* counts, int gap) {
+  counts->numberOfGaps = insertWindowSize(&counts->gaps, counts->numberOfGaps, gap);
+  counts->odHistogram = (int*) realloc(counts->odHistogram,
+                                       (counts->numberOfGaps + 1) * sizeof(int));
+}
+
+void addUnorderedWindowCounts(WindowCounts* counts, int window) {
+  counts->numberOfWindows = insertWindowSize(&counts->windows, counts->numberOfWindows,
+                                             window);
+  counts->uwHistogram = (int*) realloc(counts->uwHistogram,
+                                       (counts->numberOfWindows + 1) * sizeof(int));
+}
+
+/**
+ * Creates window counts for the same gaps and windows as "counts," e.g.,
+ * one per thread, since counts hold the state of the current document.
+ */
+WindowCounts* copyWindowCounts(WindowCounts* counts) {
+  WindowCounts* copy = createWindowCounts();
+  int i;
+  for(i = 0; i < counts->numberOfGaps; i++) {
+    addOrderedWindowCounts(copy, counts->gaps[i]);
+  }
+  for(i = 0; i < counts->numberOfWindows; i++) {
+    addUnorderedWindowCounts(copy, counts->windows[i]);
+  }
+  return copy;
+}
+
+/**
+ * Returns the index of the smallest size in "sizes" that is not less
+ * than "value," or "length" if there is none.
+ */
+int findWindowSize(int* sizes, int length, int value) {
+  int i;
+  for(i = 0; i < length && sizes[i] < value; i++);
+  return i;
+}
+
+/**
+ * Computes the counts of every registered gap and window, for every
+ * pair of adjacent query terms, in the current document. Each pair of
+ * position lists is merged once: every match is filed under the
+ * smallest gap (window) it qualifies for, and the counts are the prefix
+ * sums of these buckets.
+ *
+ * @param counts Window counts
+ * @param positions Positions of every query term, each list preceded
+ *        by its length and sorted in increasing order
+ * @param qlength Number of query terms
+ */
+void computeWindowCounts(WindowCounts* counts, int** positions, int qlength) {
+  int pairs = qlength - 1;
+  if(pairs < 1) {
+    return;
+  }
+  if(pairs > counts->capacity) {
+    counts->capacity = pairs;
+    counts->od = (int*) realloc(counts->od,
+                                (counts->numberOfGaps * pairs + 1) * sizeof(int));
+    counts->uw = (int*) realloc(counts->uw,
+                                (counts->numberOfWindows * pairs + 1) * sizeof(int));
+  }
+  counts->pairs = pairs;
+
+  int G = counts->numberOfGaps, W = counts->numberOfWindows;
+  int* odHistogram = counts->odHistogram;
+  int* uwHistogram = counts->uwHistogram;
+  int i, j, g, w;
+  for(i = 0; i < pairs; i++) {
+    int* p = &positions[i][1];
+    int* pn = &positions[i + 1][1];
+    int n = positions[i][0], m = positions[i + 1][0];
+    for(g = 0; g <= G; g++) odHistogram[g] = 0;
+    for(w = 0; w <= W; w++) uwHistogram[w] = 0;
+
+    // pn[k] is the first position after p[j - 1]
+    int k = 0;
+    for(j = 0; j < n; j++) {
+      for(; k < m && pn[k] < p[j]; k++) {
+        if(W) uwHistogram[findWindowSize(counts->windows, W, p[j] - pn[k] + 1)]++;
+      }
+      if(k < m && pn[k] == p[j]) {
+        k++;
+      }
+      if(k < m) {
+        int distance = pn[k] - p[j];
+        if(G) odHistogram[findWindowSize(counts->gaps, G, distance - 1)]++;
+        if(W) uwHistogram[findWindowSize(counts->windows, W, distance + 1)]++;
+      }
+    }
+
+    int sum = 0;
+    for(g = 0; g < G; g++) {
+      sum += odHistogram[g];
+      counts->od[g * pairs + i] = sum;
+    }
+    sum = 0;
+    for(w = 0; w < W; w++) {
+      sum += uwHistogram[w];
+      counts->uw[w * pairs + i] = sum;
+    }
+  }
+}
+
+/**
+ * Returns the OD counts of the current document under a registered
+ * gap, one per pair of adjacent query terms.
+ */
+int* getOrderedWindowCounts(WindowCounts* counts, int gap) {
+  return &counts->od[findWindowSize(counts->gaps, counts->numberOfGaps, gap) *
+                     counts->pairs];
+}
+
+/**
+ * Returns the UW counts of the current document under a registered
+ * window, one per pair of adjacent query terms.
+ */
+int* getUnorderedWindowCounts(WindowCounts* counts, int window) {
+  return &counts->uw[findWindowSize(counts->windows, counts->numberOfWindows, window) *
+                     counts->pairs];
+}
+
+#endif
@@ -13,6 +13,8 @@ struct Heap {
   int index;
 };
 
+int deleteMinHeap(Heap* heap);
+
 Heap* initHeap(int size) {
   Heap* heap = (Heap*) malloc(sizeof(Heap));
   heap->index = 0;
@@ -5,55 +5,142 @@
 #include <stdio.h>
 #include <string.h>
 #include "SegmentPool.h"
+#include "QueryContext.h"
+#include "intersection/SvS.h"
 
 #define TERMINAL_DOCID -1
 
-int* bwandAnd(SegmentPool* pool, long* headPointers,
-           int len, int hits) {
-  int* set = (int*) calloc(hits, sizeof(int));
-  unsigned int* blockDocid = (unsigned int*) calloc(2 * BLOCK_SIZE, sizeof(unsigned int));
+/**
+ * Removes Bloom filter false positives: looks up the docids left in
+ * "mask" in the compressed docid blocks of a list. Only blocks that may
+ * contain a candidate, found using the segment headers and the skip
+ * list, are decompressed.
+ *
+ * @param pool Segment pool
+ * @param list Skip list of the postings list, or NULL
+ * @param docids Sorted document ids
+ * @param count Number of document ids
+ * @param pointer Pointer to the segment decoded in "data." It only
+ *        moves forward.
+ * @param data Decoded docid block of that segment
+ * @param dataCount Number of docids in "data," or 0 if no block has
+ *        been decoded yet
+ * @param mask Bitmask with one bit per docid. On input, the candidates;
+ *        on output, those that exist in the list.
+ * @return Number of docids that exist in the list
+ */
+int verifyDocidBlock(SegmentPool* pool, SkipList* list, unsigned int* docids, int count,
+                     long* pointer, unsigned int* data, int* dataCount,
+                     unsigned long* mask) {
+  int i, index = 0, matches = 0;
+  for(i = nextBitMask(mask, 0, count); i < count; i = nextBitMask(mask, i + 1, count)) {
+    long segment = seekSegment(pool, list, *pointer, docids[i]);
+    if(segment == UNDEFINED_POINTER) {
+      for(; i < count; i++) {
+        CLEAR_BIT_MASK(mask, i);
+      }
+      break;
+    }
+    // Dense segments are tested exactly, without being decoded
+    if(isBitmapContainer(pool, segment)) {
+      if(containsBitmapContainer(getDocidBlock(pool, segment), docids[i])) {
+        matches++;
+      } else {
+        CLEAR_BIT_MASK(mask, i);
+      }
+      continue;
+    }
+    if(segment != *pointer || *dataCount == 0) {
+      *pointer = segment;
+      *dataCount = decompressDocidBlock(pool, data, segment);
+      index = 0;
+    }
+    index = lowerBound(data, index, *dataCount, docids[i], pool->reverse);
+    if(index < *dataCount && data[index] == docids[i]) {
+      matches++;
+    } else {
+      CLEAR_BIT_MASK(mask, i);
+    }
+  }
+  return matches;
+}
+
+/**
+ * Conjunctive query processing over Bloom filter chains. Candidates
+ * come from the shortest list and are tested against the Bloom filters
+ * of the other lists, so the result may contain false positives unless
+ * "exact" is set, in which case every candidate that passes the
+ * filters is also looked up in the docid blocks of the other lists.
+ */
+int* bwandAnd(SegmentPool* pool, long* headPointers, SkipList** skipLists,
+              int len, int hits, int exact, QueryContext* context) {
+  int* set = (int*) allocateQueryContext(context, hits * sizeof(int));
+  unsigned int* blockDocid = (unsigned int*)
+    allocateQueryContext(context, 2 * BLOCK_SIZE * sizeof(unsigned int));
   unsigned int count;
   int posting;
   int i, j, iSet = 0, left = 1;
 
   count = decompressDocidBlock(pool, blockDocid, headPointers[0]);
-  posting = 0;
 
-  while(left) {
-    int pivot = blockDocid[posting++];
+  // Docids of the current block that may exist in every list
+  unsigned long mask[BLOOM_FILTER_MASK_WORDS];
+
+  // Exact verification: the block of each list decoded last
+  long* verifyPointers = NULL;
+  unsigned int** verifyData = NULL;
+  int* verifyCount = NULL;
+  if(exact) {
+    verifyPointers = (long*) allocateQueryContext(context, len * sizeof(long));
+    verifyData = (unsigned int**) allocateQueryContext(context, len * sizeof(unsigned int*));
+    verifyCount = (int*) allocateQueryContext(context, len * sizeof(int));
+    for(i = 1; i < len; i++) {
+      verifyPointers[i] = headPointers[i];
+      verifyData[i] = (unsigned int*)
+        allocateQueryContext(context, BLOCK_SIZE * 2 * sizeof(unsigned int));
+    }
+  }
 
-    int found = 1;
+  while(left) {
+    for(j = 0; j < BLOOM_FILTER_MASK_WORDS; j++) {
+      mask[j] = ~0ul;
+    }
     for(i = 1; i < len; i++) {
-      if(headPointers[i] == UNDEFINED_POINTER) {
-        left = 0;
-        found = 0;
+      if(!containsDocidBlock(pool, skipLists[i], blockDocid, count, &headPointers[i], mask)) {
         break;
       }
-      if(!containsDocid(pool, pivot, &headPointers[i])) {
-        found = 0;
-        break;
+    }
+    // A list that has run out cannot contain any later docid
+    if(i < len && headPointers[i] == UNDEFINED_POINTER) {
+      left = 0;
+    }
+
+    if(i == len && exact) {
+      for(i = 1; i < len; i++) {
+        if(!verifyDocidBlock(pool, skipLists[i], blockDocid, count, &verifyPointers[i],
+                             verifyData[i], &verifyCount[i], mask)) {
+          break;
+        }
       }
     }
 
-    if(found) {
-      set[iSet++] = pivot;
+    if(i == len) {
+      for(posting = nextBitMask(mask, 0, count); posting < count && iSet < hits;
+          posting = nextBitMask(mask, posting + 1, count)) {
+        set[iSet++] = blockDocid[posting];
+      }
       if(iSet >= hits) break;
     }
 
-    if(posting == count && left) {
+    if(left) {
       headPointers[0] = nextPointer(pool, headPointers[0]);
       if(headPointers[0] == UNDEFINED_POINTER) {
         break;
       }
-      memset(blockDocid, 0, BLOCK_SIZE * 2 * sizeof(unsigned int));
       count = decompressDocidBlock(pool, blockDocid, headPointers[0]);
-      posting = 0;
     }
   }
 
-  // Free the allocated memory
-  free(blockDocid);
-
   if(iSet < hits) {
     set[iSet] = TERMINAL_DOCID;
   }
@@ -6,13 +6,16 @@
 #include <string.h>
 #include "heap/Heap.h"
 #include "SegmentPool.h"
+#include "QueryContext.h"
 
 #define TERMINAL_DOCID -1
 
-int* bwandOr(SegmentPool* pool, long* headPointers,
-             float* UB, int len, int hits, float** scores) {
-  Heap* elements = initHeap(hits);
-  unsigned int* blockDocid = (unsigned int*) calloc(2 * BLOCK_SIZE, sizeof(unsigned int));
+int* bwandOr(SegmentPool* pool, long* headPointers, SkipList** skipLists,
+             float* UB, int len, int hits, float** scores,
+             QueryContext* context) {
+  Heap* elements = getHeapQueryContext(context, hits);
+  unsigned int* blockDocid = (unsigned int*)
+    allocateQueryContext(context, 2 * BLOCK_SIZE * sizeof(unsigned int));
   unsigned int count;
   int posting;
   float threshold = 0;
@@ -23,52 +26,60 @@ int* bwandOr(SegmentPool* pool, long* headPointers,
   }
 
   count = decompressDocidBlock(pool, blockDocid, headPointers[0]);
-  posting = 0;
   if(UB[0] <= threshold) {
     threshold = UB[0] - 1;
   }
 
-  while(1) {
-    int pivot = blockDocid[posting++];
+  // Membership of the current block in each of the other lists
+  unsigned long* matches = (unsigned long*)
+    allocateQueryContext(context, len * BLOOM_FILTER_MASK_WORDS * sizeof(unsigned long));
 
-    float score = UB[0];
+  while(1) {
     for(i = 1; i < len; i++) {
-      if(containsDocid(pool, pivot, &headPointers[i])) {
-        score += UB[i];
+      unsigned long* mask = &matches[i * BLOOM_FILTER_MASK_WORDS];
+      for(j = 0; j < BLOOM_FILTER_MASK_WORDS; j++) {
+        mask[j] = ~0ul;
       }
+      containsDocidBlock(pool, skipLists[i], blockDocid, count, &headPointers[i], mask);
     }
 
-    if(score > threshold) {
-      insertHeap(elements, pivot, score);
-      if(isFullHeap(elements)) {
-        threshold = minScoreHeap(elements);
-        if(threshold == sumOfUB) {
-          break;
+    for(posting = 0; posting < count; posting++) {
+      int pivot = blockDocid[posting];
+
+      float score = UB[0];
+      for(i = 1; i < len; i++) {
+        if(IS_SET_BIT_MASK(&matches[i * BLOOM_FILTER_MASK_WORDS], posting)) {
+          score += UB[i];
         }
       }
-    }
 
-    if(posting == count) {
-      headPointers[0] = nextPointer(pool, headPointers[0]);
-      if(headPointers[0] == UNDEFINED_POINTER) {
-        break;
+      if(score > threshold) {
+        insertHeap(elements, pivot, score);
+        if(isFullHeap(elements)) {
+          threshold = minScoreHeap(elements);
+          if(threshold == sumOfUB) {
+            break;
+          }
+        }
       }
-      memset(blockDocid, 0, BLOCK_SIZE * 2 * sizeof(unsigned int));
-      count = decompressDocidBlock(pool, blockDocid, headPointers[0]);
-      posting = 0;
     }
-  }
+    if(posting < count) {
+      break;
+    }
 
-  // Free the allocated memory
-  free(blockDocid);
+    headPointers[0] = nextPointer(pool, headPointers[0]);
+    if(headPointers[0] == UNDEFINED_POINTER) {
+      break;
+    }
+    count = decompressDocidBlock(pool, blockDocid, headPointers[0]);
+  }
 
-  int* set = (int*) calloc(elements->index + 1, sizeof(int));
+  int* set = (int*) allocateQueryContext(context, (elements->index + 1) * sizeof(int));
   memcpy(set, &elements->docid[1], elements->index * sizeof(int));
   memcpy(*scores, &elements->score[1], elements->index *sizeof(float));
   if(!isFullHeap(elements)) {
     set[elements->index] = TERMINAL_DOCID;
   }
-  destroyHeap(elements);
   return set;
 }
 
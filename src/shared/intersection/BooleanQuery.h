@@ -0,0 +1,336 @@
+#ifndef BOOLEAN_QUERY_H_GUARD
+#define BOOLEAN_QUERY_H_GUARD
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include "heap/Heap.h"
+#include "scorer/BM25.h"
+#include "SegmentPool.h"
+#include "Pointers.h"
+#include "PostingsList.h"
+#include "QueryContext.h"
+#include "query/QueryParser.h"
+
+#define TERMINAL_DOCID -1
+
+int nextGEQQueryNode(SegmentPool* pool, QueryNode* node, unsigned int docid);
+
+/**
+ * Moves every operand of a conjunction (#and, or the terms of a
+ * window) to the first document, not less than "docid," that all of
+ * them match. Operands are visited in the given order (#and operands
+ * are sorted by cost) and leapfrog each other: as soon as an operand
+ * lands past the candidate, it becomes the new candidate. #not operands
+ * are ignored.
+ *
+ * @return 0 if one of the operands has been exhausted, 1 otherwise
+ */
+int alignQueryNodes(SegmentPool* pool, QueryNode** nodes, int len, unsigned int* docid) {
+  int i = 0, aligned = 0;
+  while(aligned < len) {
+    QueryNode* node = nodes[i];
+    if(node->op != QUERY_NOT) {
+      if(!nextGEQQueryNode(pool, node, *docid)) {
+        return 0;
+      }
+      if(node->docid != *docid) {
+        *docid = node->docid;
+        aligned = 0;
+      }
+    }
+    aligned++;
+    i = (i + 1) % len;
+  }
+  return 1;
+}
+
+/**
+ * Points the node at the positions of the terms of a window, in the
+ * current document of their cursors. Only the postings that made it
+ * through the docid intersection get their positions decoded.
+ */
+void loadWindowPositions(QueryNode* node) {
+  int i;
+  for(i = 0; i < node->numberOfChildren; i++) {
+    node->positionsCount[i] = getPositionSpanCursor(node->children[i]->cursor,
+                                                    &node->positions[i]);
+  }
+}
+
+/**
+ * Checks whether terms i, i + 1, ... of an ordered window follow position
+ * p: term i occurs at most "window" positions after p, and terms i + 1,
+ * ... follow that occurrence in turn. Positions for which the rest of the
+ * window cannot follow are skipped for good, and the position found is
+ * kept, so the merge index of each term only moves forward as long as p
+ * does.
+ */
+int followsOrderedWindow(QueryNode* node, int i, unsigned int p) {
+  int* index = &node->positionsCount[node->numberOfChildren];
+  while(index[i] < node->positionsCount[i]) {
+    unsigned int q = node->positions[i][index[i]];
+    if(q <= p) {
+      index[i]++;
+      continue;
+    }
+    if(q - p > node->window) {
+      return 0;
+    }
+    if(i == node->numberOfChildren - 1 || followsOrderedWindow(node, i + 1, q)) {
+      return 1;
+    }
+    index[i]++;
+  }
+  return 0;
+}
+
+/**
+ * Counts the occurrences of an ordered window: positions p of the first
+ * term from which every next term follows, in order, at most "window"
+ * positions after the previous one.
+ */
+int countOrderedWindow(QueryNode* node) {
+  int i, j, len = node->numberOfChildren, count = 0;
+  int* index = &node->positionsCount[len];
+  for(i = 1; i < len; i++) {
+    index[i] = 0;
+  }
+  for(j = 0; j < node->positionsCount[0]; j++) {
+    if(len == 1 || followsOrderedWindow(node, 1, node->positions[0][j])) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/**
+ * Counts the occurrences of an unordered window: positions p, at which
+ * one of the terms occurs, such that every term occurs in the window of
+ * "window" positions that starts at p.
+ */
+int countUnorderedWindow(QueryNode* node) {
+  int i, len = node->numberOfChildren, count = 0;
+  int* index = &node->positionsCount[len];
+  for(i = 0; i < len; i++) {
+    index[i] = 0;
+  }
+  while(1) {
+    // The next start is the smallest position not visited yet
+    int found = 0;
+    unsigned int p = 0;
+    for(i = 0; i < len; i++) {
+      if(index[i] < node->positionsCount[i] &&
+         (!found || node->positions[i][index[i]] < p)) {
+        p = node->positions[i][index[i]];
+        found = 1;
+      }
+    }
+    if(!found) {
+      break;
+    }
+
+    int match = 1;
+    for(i = 0; i < len; i++) {
+      while(index[i] < node->positionsCount[i] && node->positions[i][index[i]] < p) {
+        index[i]++;
+      }
+      if(index[i] == node->positionsCount[i] ||
+         node->positions[i][index[i]] - p >= node->window) {
+        match = 0;
+      }
+    }
+    count += match;
+
+    // Move past p
+    for(i = 0; i < len; i++) {
+      if(index[i] < node->positionsCount[i] && node->positions[i][index[i]] == p) {
+        index[i]++;
+      }
+    }
+  }
+  return count;
+}
+
+/**
+ * Moves a node to the first document, not less than "docid" (in
+ * traversal order), that it matches, regardless of its current document.
+ *
+ * @return 0 if the node matches no more documents, 1 otherwise
+ */
+int searchQueryNode(SegmentPool* pool, QueryNode* node, unsigned int docid) {
+  int i;
+  if(node->op == QUERY_TERM) {
+    if(!nextGEQCursor(node->cursor, docid)) {
+      node->valid = 0;
+      return 0;
+    }
+    node->docid = getDocidCursor(node->cursor);
+  } else if(node->op == QUERY_OR || node->op == QUERY_WEIGHT) {
+    int found = 0;
+    for(i = 0; i < node->numberOfChildren; i++) {
+      QueryNode* child = node->children[i];
+      if(nextGEQQueryNode(pool, child, docid) &&
+         (!found || LESS_THAN(child->docid, node->docid, pool->reverse))) {
+        node->docid = child->docid;
+        found = 1;
+      }
+    }
+    node->valid = found;
+  } else {
+    // #and and windows: align the operands, then check the document
+    while(1) {
+      if(!alignQueryNodes(pool, node->children, node->numberOfChildren, &docid)) {
+        node->valid = 0;
+        break;
+      }
+
+      int match = 1;
+      if(node->op == QUERY_AND) {
+        // Excluded documents are filtered out here, instead of after
+        // retrieval, so they never reach the heap
+        for(i = 0; i < node->numberOfChildren && match; i++) {
+          QueryNode* child = node->children[i];
+          if(child->op == QUERY_NOT) {
+            QueryNode* excluded = child->children[0];
+            match = !nextGEQQueryNode(pool, excluded, docid) || excluded->docid != docid;
+          }
+        }
+      } else {
+        loadWindowPositions(node);
+        node->tf = node->op == QUERY_ORDERED_WINDOW ?
+          countOrderedWindow(node) : countUnorderedWindow(node);
+        match = node->tf > 0;
+      }
+      if(match) {
+        node->docid = docid;
+        break;
+      }
+      docid = pool->reverse ? docid - 1 : docid + 1;
+    }
+  }
+  return node->valid;
+}
+
+/**
+ * Moves a node to the first document, not less than "docid," that it
+ * matches. Nodes never move backwards, and cursors skip over whole
+ * blocks using the last docid stored in the segment headers.
+ *
+ * @return 0 if the node matches no more documents, 1 otherwise
+ */
+int nextGEQQueryNode(SegmentPool* pool, QueryNode* node, unsigned int docid) {
+  if(!node->valid) {
+    return 0;
+  }
+  if(!LESS_THAN(node->docid, docid, pool->reverse)) {
+    return 1;
+  }
+  return searchQueryNode(pool, node, docid);
+}
+
+/**
+ * Creates cursors for the terms of the query, and moves every node to
+ * the first document it matches.
+ */
+void prepareQueryNode(SegmentPool* pool, QueryNode* node, Pointers* pointers,
+                      QueryContext* context) {
+  int i;
+  for(i = 0; i < node->numberOfChildren; i++) {
+    prepareQueryNode(pool, node->children[i], pointers, context);
+  }
+
+  node->valid = 1;
+  if(node->op == QUERY_TERM) {
+    long headPointer = node->termid >= 0 ?
+      getHeadPointer(pointers, node->termid) : UNDEFINED_POINTER;
+    node->cursor = createCursor(pool, headPointer, node->cost, context);
+    node->valid = isValidCursor(node->cursor);
+    if(node->valid) {
+      node->docid = getDocidCursor(node->cursor);
+    }
+    return;
+  }
+
+  if(node->op == QUERY_ORDERED_WINDOW || node->op == QUERY_UNORDERED_WINDOW) {
+    int len = node->numberOfChildren;
+    node->positions = (unsigned int**)
+      allocateQueryContext(context, len * sizeof(unsigned int*));
+    // Followed by the merge indexes of the window counts
+    node->positionsCount = (int*) allocateQueryContext(context, 2 * len * sizeof(int));
+  }
+
+  // #not is never positioned itself; its operand is
+  if(node->op != QUERY_NOT) {
+    searchQueryNode(pool, node, pool->reverse ? 0xFFFFFFFF : 0);
+  }
+}
+
+/**
+ * Scores the current document of a node, which must be "docid," with
+ * BM25 (default parameters): terms are scored individually, windows
+ * with their number of occurrences and the default idf, and operators
+ * add up the scores of their operands that match the document.
+ */
+float scoreQueryNode(QueryNode* node, unsigned int docid, Pointers* pointers) {
+  float score = 0;
+  int i;
+  if(node->op == QUERY_TERM) {
+    score = scoreCursor(node->cursor, pointers->docLen->counter, pointers->totalDocs,
+                        pointers->totalDocLen / (float) pointers->totalDocs);
+  } else if(node->op == QUERY_ORDERED_WINDOW || node->op == QUERY_UNORDERED_WINDOW) {
+    score = bm25Phrase(node->tf, pointers->docLen->counter[docid],
+                       pointers->totalDocLen / (float) pointers->totalDocs,
+                       pointers->defaultIdf, DEFAULT_K1, DEFAULT_B);
+  } else {
+    for(i = 0; i < node->numberOfChildren; i++) {
+      QueryNode* child = node->children[i];
+      if(child->op != QUERY_NOT && child->valid && child->docid == docid) {
+        score += scoreQueryNode(child, docid, pointers);
+      }
+    }
+  }
+  return node->weight * score;
+}
+
+/**
+ * Evaluates a structured query, document at a time, and returns the
+ * top-k matching documents by score.
+ *
+ * @param pool Segment pool
+ * @param root Root of the operator tree
+ * @param pointers Pointers of the index (document frequencies and lengths)
+ * @param hits Number of documents to retrieve
+ * @param scores Output scores, in the same order as the output docids
+ * @param context Query context to draw temporary buffers from
+ * @return Top-k docids, in heap order. If fewer than "hits" documents
+ *         match, the list ends with TERMINAL_DOCID.
+ */
+int* evaluateBooleanQuery(SegmentPool* pool, QueryNode* root, Pointers* pointers,
+                          int hits, float** scores, QueryContext* context) {
+  Heap* elements = getHeapQueryContext(context, hits);
+  float threshold = -FLT_MAX;
+
+  prepareQueryNode(pool, root, pointers, context);
+  while(root->valid) {
+    unsigned int docid = root->docid;
+    float score = scoreQueryNode(root, docid, pointers);
+    if(!isFullHeap(elements) || score > threshold) {
+      insertHeap(elements, docid, score);
+      if(isFullHeap(elements)) {
+        threshold = minScoreHeap(elements);
+      }
+    }
+    nextGEQQueryNode(pool, root, pool->reverse ? docid - 1 : docid + 1);
+  }
+
+  int* set = (int*) allocateQueryContext(context, (elements->index + 1) * sizeof(int));
+  memcpy(set, &elements->docid[1], elements->index * sizeof(int));
+  memcpy(*scores, &elements->score[1], elements->index * sizeof(float));
+  if(!isFullHeap(elements)) {
+    set[elements->index] = TERMINAL_DOCID;
+  }
+  return set;
+}
+
+#endif
@@ -0,0 +1,190 @@
+#ifndef MAX_SCORE_H_GUARD
+#define MAX_SCORE_H_GUARD
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "heap/Heap.h"
+#include "scorer/BM25.h"
+#include "SegmentPool.h"
+#include "QueryContext.h"
+#include "intersection/SvS.h"
+
+#define TERMINAL_DOCID -1
+
+/**
+ * Disjunctive top-k query processing using MaxScore. Terms are sorted
+ * by upper bound. The lists whose upper bounds add up to no more than
+ * the current threshold are "non-essential": a document that appears
+ * only in them cannot enter the top-k. Candidates are therefore drawn
+ * from the essential lists only. Non-essential lists are probed, in
+ * decreasing order of upper bound, only while the candidate can still
+ * make it into the top-k.
+ *
+ * Parameters and output are the same as those of wand (without microblog
+ * scoring). Scores are summed in term order, as in wand, so that both
+ * rank documents identically. The top-k scores are those of an
+ * exhaustive evaluation. When several documents tie with the k-th
+ * score, which of them are returned depends on the order in which the
+ * heap sees them, and is the same as with wand.
+ */
+int* maxScore(SegmentPool* pool, long* headPointers, int* df, float* UB, int len,
+              int* docLen, int totalDocs, float avgDocLen, int hits,
+              float** scores, QueryContext* context) {
+  Heap* elements = getHeapQueryContext(context, hits);
+  unsigned int** blockDocid = (unsigned int**)
+    allocateQueryContext(context, len * sizeof(unsigned int*));
+  unsigned int** blockTf = (unsigned int**)
+    allocateQueryContext(context, len * sizeof(unsigned int*));
+  int* counts = (int*) allocateQueryContext(context, len * sizeof(int));
+  int* posting = (int*) allocateQueryContext(context, len * sizeof(int));
+  // Whether the tf block of each cursor's current segment has been decoded
+  int* tfDecoded = (int*) allocateQueryContext(context, len * sizeof(int));
+  // Whether each cursor still has postings
+  int* live = (int*) allocateQueryContext(context, len * sizeof(int));
+  // Terms in increasing order of upper bound
+  int* order = (int*) allocateQueryContext(context, len * sizeof(int));
+  // Sum of the upper bounds of order[0..i]
+  float* prefixUB = (float*) allocateQueryContext(context, len * sizeof(float));
+  // Score contribution of each term to the current candidate, if it matched
+  float* contribution = (float*) allocateQueryContext(context, len * sizeof(float));
+  int* matched = (int*) allocateQueryContext(context, len * sizeof(int));
+  float threshold = 0;
+
+  int i, j;
+  for(i = 0; i < len; i++) {
+    blockDocid[i] = (unsigned int*)
+      allocateQueryContext(context, BLOCK_SIZE * 2 * sizeof(unsigned int));
+    blockTf[i] = (unsigned int*)
+      allocateQueryContext(context, BLOCK_SIZE * 2 * sizeof(unsigned int));
+    counts[i] = decompressDocidBlock(pool, blockDocid[i], headPointers[i]);
+    posting[i] = 0;
+    live[i] = 1;
+    if(UB[i] <= threshold) {
+      threshold = UB[i] - 1;
+    }
+
+    // Insertion sort by upper bound, breaking ties by term
+    for(j = i - 1; j >= 0 && UB[order[j]] > UB[i]; j--) {
+      order[j + 1] = order[j];
+    }
+    order[j + 1] = i;
+  }
+  for(i = 0; i < len; i++) {
+    prefixUB[i] = UB[order[i]] + (i > 0 ? prefixUB[i - 1] : 0);
+  }
+
+  // Lists order[0..firstEssential) are non-essential
+  int firstEssential = 0;
+  while(firstEssential < len && prefixUB[firstEssential] <= threshold) {
+    firstEssential++;
+  }
+
+  while(firstEssential < len) {
+    // The next candidate is the first docid among the essential lists
+    int found = 0;
+    unsigned int docid = 0;
+    for(i = firstEssential; i < len; i++) {
+      int t = order[i];
+      if(live[t] && (!found || LESS_THAN(blockDocid[t][posting[t]], docid, pool->reverse))) {
+        docid = blockDocid[t][posting[t]];
+        found = 1;
+      }
+    }
+    if(!found) {
+      break;
+    }
+
+    // Score the essential lists, and move them past the candidate
+    float bound = firstEssential > 0 ? prefixUB[firstEssential - 1] : 0;
+    for(i = 0; i < len; i++) {
+      matched[i] = 0;
+    }
+    for(i = firstEssential; i < len; i++) {
+      int t = order[i];
+      if(!live[t] || blockDocid[t][posting[t]] != docid) {
+        continue;
+      }
+      // Term frequencies are only decoded for blocks that get scored
+      if(!tfDecoded[t]) {
+        decompressTfBlock(pool, blockTf[t], headPointers[t]);
+        tfDecoded[t] = 1;
+      }
+      contribution[t] = _default_bm25(blockTf[t][posting[t]], df[t], totalDocs,
+                                      docLen[docid], avgDocLen);
+      matched[t] = 1;
+      bound += contribution[t];
+
+      posting[t]++;
+      if(posting[t] >= counts[t]) {
+        headPointers[t] = nextPointer(pool, headPointers[t]);
+        if(headPointers[t] == UNDEFINED_POINTER) {
+          live[t] = 0;
+        } else {
+          counts[t] = decompressDocidBlock(pool, blockDocid[t], headPointers[t]);
+          posting[t] = 0;
+          tfDecoded[t] = 0;
+        }
+      }
+    }
+
+    // Probe the non-essential lists, as long as the candidate may still
+    // make it into the top-k
+    for(i = firstEssential - 1; i >= 0 && bound > threshold; i--) {
+      int t = order[i];
+      bound -= UB[t];
+      if(!live[t]) {
+        continue;
+      }
+      long pointer = headPointers[t];
+      if(!gallopSearch(pool, blockDocid[t], &counts[t], &posting[t],
+                       &headPointers[t], docid)) {
+        live[t] = 0;
+        continue;
+      }
+      if(headPointers[t] != pointer) {
+        tfDecoded[t] = 0;
+      }
+      if(blockDocid[t][posting[t]] == docid) {
+        if(!tfDecoded[t]) {
+          decompressTfBlock(pool, blockTf[t], headPointers[t]);
+          tfDecoded[t] = 1;
+        }
+        contribution[t] = _default_bm25(blockTf[t][posting[t]], df[t], totalDocs,
+                                        docLen[docid], avgDocLen);
+        matched[t] = 1;
+        bound += contribution[t];
+      }
+    }
+
+    if(bound <= threshold || docid == 0) {
+      continue;
+    }
+
+    float score = 0;
+    for(i = 0; i < len; i++) {
+      if(matched[i]) {
+        score += contribution[i];
+      }
+    }
+    if(score > threshold) {
+      insertHeap(elements, docid, score);
+      if(isFullHeap(elements)) {
+        threshold = minScoreHeap(elements);
+        while(firstEssential < len && prefixUB[firstEssential] <= threshold) {
+          firstEssential++;
+        }
+      }
+    }
+  }
+
+  int* set = (int*) allocateQueryContext(context, (elements->index + 1) * sizeof(int));
+  memcpy(set, &elements->docid[1], elements->index * sizeof(int));
+  memcpy(*scores, &elements->score[1], elements->index * sizeof(float));
+  if(!isFullHeap(elements)) {
+    set[elements->index] = TERMINAL_DOCID;
+  }
+  return set;
+}
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef RANKED_AND_H_GUARD
+#define RANKED_AND_H_GUARD
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include "heap/Heap.h"
+#include "scorer/BM25.h"
+#include "SegmentPool.h"
+#include "BlockMaxList.h"
+#include "QueryContext.h"
+#include "intersection/SvS.h"
+
+/**
+ * Conjunctive top-k query processing: ranks documents that contain all
+ * query terms by BM25. The shortest list drives the intersection; every
+ * other list gallops to each candidate, first over its segments (using
+ * its block-max list) and then within the decoded block.
+ *
+ * Once the heap is full, block maxima are used to skip work:
+ *
+ *  - Evaluation stops when the highest scores left in the lists add up
+ *    to no more than the threshold.
+ *  - A segment of the driving list is skipped, without being decoded,
+ *    if its maximum plus the maxima of the segments it overlaps in the
+ *    other lists cannot beat the threshold.
+ *  - A common document is only scored if the maxima of the segments it
+ *    falls into can beat the threshold.
+ *
+ * @param pool Segment pool
+ * @param lists Block-max list of each term, in increasing order of df
+ * @param df Document frequency of each term
+ * @param len Number of query terms
+ * @param docLen Document lengths
+ * @param totalDocs Number of documents in the collection
+ * @param avgDocLen Average document length
+ * @param hits Number of documents to retrieve
+ * @param scores Output scores, in the same order as the output docids
+ * @param context Query context to draw temporary buffers from
+ * @return Top-k docids, in heap order. If fewer than "hits" documents
+ *         contain all terms, the list ends with TERMINAL_DOCID.
+ */
+int* rankedAnd(SegmentPool* pool, BlockMaxList** lists, int* df, int len,
+               int* docLen, int totalDocs, float avgDocLen, int hits,
+               float** scores, QueryContext* context) {
+  Heap* elements = getHeapQueryContext(context, hits);
+  unsigned int** blockDocid = (unsigned int**)
+    allocateQueryContext(context, len * sizeof(unsigned int*));
+  unsigned int** blockTf = (unsigned int**)
+    allocateQueryContext(context, len * sizeof(unsigned int*));
+  int* counts = (int*) allocateQueryContext(context, len * sizeof(int));
+  int* posting = (int*) allocateQueryContext(context, len * sizeof(int));
+  // Index of the segment each cursor is on, and of the segment whose
+  // docids are in the decoding buffer
+  int* segment = (int*) allocateQueryContext(context, len * sizeof(int));
+  int* decoded = (int*) allocateQueryContext(context, len * sizeof(int));
+  // Whether the tf block of the decoded segment has been decoded
+  int* tfDecoded = (int*) allocateQueryContext(context, len * sizeof(int));
+  // Scores are only compared against the threshold once the heap is full
+  float threshold = -FLT_MAX;
+  int reverse = pool->reverse;
+  // Set once one of the lists runs out of postings
+  int exhausted = 0;
+
+  int i;
+  for(i = 0; i < len; i++) {
+    blockDocid[i] = (unsigned int*)
+      allocateQueryContext(context, BLOCK_SIZE * 2 * sizeof(unsigned int));
+    blockTf[i] = (unsigned int*)
+      allocateQueryContext(context, BLOCK_SIZE * 2 * sizeof(unsigned int));
+    segment[i] = 0;
+    decoded[i] = -1;
+    tfDecoded[i] = 0;
+  }
+
+  BlockMaxList* driver = lists[0];
+  int s;
+  for(s = 0; s < driver->length && !exhausted; s++) {
+    if(isFullHeap(elements)) {
+      // Stop if no document left can enter the top-k
+      float bound = driver->remainingMaxScore[s];
+      for(i = 1; i < len; i++) {
+        bound += lists[i]->remainingMaxScore[segment[i]];
+      }
+      if(bound <= threshold) {
+        break;
+      }
+
+      // Skip this segment if none of its documents can enter the top-k.
+      // Other cursors move past the previous segment, and the maxima of
+      // the segments that overlap this one are added up.
+      bound = driver->maxScore[s];
+      for(i = 1; i < len && !exhausted; i++) {
+        if(s > 0) {
+          segment[i] = seekBlockMaxList(lists[i], segment[i],
+                                        driver->maxDocId[s - 1], reverse);
+          if(segment[i] == lists[i]->length) {
+            exhausted = 1;
+            break;
+          }
+        }
+        int k = segment[i];
+        float max = lists[i]->maxScore[k];
+        while(k + 1 < lists[i]->length &&
+              LESS_THAN(lists[i]->maxDocId[k], driver->maxDocId[s], reverse)) {
+          k++;
+          if(lists[i]->maxScore[k] > max) {
+            max = lists[i]->maxScore[k];
+          }
+        }
+        bound += max;
+      }
+      if(exhausted || bound <= threshold) {
+        continue;
+      }
+    }
+
+    counts[0] = decompressDocidBlock(pool, blockDocid[0], driver->pointers[s]);
+    tfDecoded[0] = 0;
+    int p = 0;
+    while(p < counts[0] && !exhausted) {
+      unsigned int docid = blockDocid[0][p];
+
+      // Move every other cursor to the candidate
+      unsigned int next = docid;
+      for(i = 1; i < len && next == docid; i++) {
+        if(LESS_THAN(lists[i]->maxDocId[segment[i]], docid, reverse)) {
+          segment[i] = seekBlockMaxList(lists[i], segment[i], docid, reverse);
+          if(segment[i] == lists[i]->length) {
+            exhausted = 1;
+            break;
+          }
+        }
+        if(decoded[i] != segment[i]) {
+          counts[i] = decompressDocidBlock(pool, blockDocid[i],
+                                           lists[i]->pointers[segment[i]]);
+          posting[i] = 0;
+          decoded[i] = segment[i];
+          tfDecoded[i] = 0;
+        }
+        posting[i] = lowerBound(blockDocid[i], posting[i], counts[i], docid, reverse);
+        next = blockDocid[i][posting[i]];
+      }
+
+      if(exhausted) {
+        break;
+      }
+      if(next != docid) {
+        // Leapfrog: the driver moves to the docid the mismatch landed on
+        p = lowerBound(blockDocid[0], p + 1, counts[0], next, reverse);
+        continue;
+      }
+
+      float score = 0;
+      if(isFullHeap(elements)) {
+        float bound = driver->maxScore[s];
+        for(i = 1; i < len; i++) {
+          bound += lists[i]->maxScore[segment[i]];
+        }
+        if(bound <= threshold) {
+          p++;
+          continue;
+        }
+      }
+
+      for(i = 0; i < len; i++) {
+        // Term frequencies are only decoded for blocks that get scored
+        if(!tfDecoded[i]) {
+          decompressTfBlock(pool, blockTf[i], i == 0 ? driver->pointers[s] :
+                            lists[i]->pointers[segment[i]]);
+          tfDecoded[i] = 1;
+        }
+        score += _default_bm25(blockTf[i][i == 0 ? p : posting[i]], df[i], totalDocs,
+                               docLen[docid], avgDocLen);
+      }
+      if(!isFullHeap(elements) || score > threshold) {
+        insertHeap(elements, docid, score);
+        if(isFullHeap(elements)) {
+          threshold = minScoreHeap(elements);
+        }
+      }
+      p++;
+    }
+  }
+
+  int* set = (int*) allocateQueryContext(context, (elements->index + 1) * sizeof(int));
+  memcpy(set, &elements->docid[1], elements->index * sizeof(int));
+  memcpy(*scores, &elements->score[1], elements->index * sizeof(float));
+  if(!isFullHeap(elements)) {
+    set[elements->index] = TERMINAL_DOCID;
+  }
+  return set;
+}
+
+#endif
@@ -5,236 +5,217 @@
 #include <stdio.h>
 #include <string.h>
 #include "SegmentPool.h"
+#include "QueryContext.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define MIN(X, Y) (X < Y ? X : Y)
 #define TERMINAL_DOCID -1
 
-// Gallop to >= docid
-inline int gallopSearch(SegmentPool* pool, int* data, int* count,
-                        int* index, long* pointer, int docid) {
-  while(1) {
-    if(*index == *count) {
-      (*pointer) = nextPointer(pool, *pointer);
-      if(*pointer == UNDEFINED_POINTER) {
-        return 0;
-      }
-      memset(data, 0, BLOCK_SIZE * 2 * sizeof(unsigned int));
-      (*count) = decompressDocidBlock(pool, data, *pointer);
-      (*index) = 0;
-    }
-    if(data[*count - 1] == docid) {
-      (*index) = *count - 1;
-      return 1;
-    } else if(LESS_THAN(data[*count - 1], docid, pool->reverse)) {
-      (*index) = *count;
-      continue;
+// Number of docids compared at once at the end of a search
+#define SEARCH_CHUNK 16
+
+/**
+ * Returns the index of the first docid in data[index, count) that is
+ * not less than "docid," or count if there is none. Gallops over
+ * SEARCH_CHUNK-sized steps, narrows the range down to a single chunk
+ * with a binary search, then compares the whole chunk against "docid"
+ * at once (with SSE2 when available).
+ *
+ * Note that data must be readable up to index + SEARCH_CHUNK, which is
+ * always the case for the BLOCK_SIZE * 2 decoding buffers.
+ */
+int lowerBound(unsigned int* data, int index, int count,
+               unsigned int docid, int reverse) {
+  int hop = SEARCH_CHUNK;
+  while(index + hop <= count && LESS_THAN(data[index + hop - 1], docid, reverse)) {
+    index += hop;
+    hop *= 2;
+  }
+  int end = MIN(index + hop, count);
+  while(end - index > SEARCH_CHUNK) {
+    int mid = index + (end - index) / 2;
+    if(LESS_THAN(data[mid - 1], docid, reverse)) {
+      index = mid;
+    } else {
+      end = mid;
     }
+  }
 
-    if(GREATER_THAN_EQUAL(data[*index], docid, pool->reverse)) {
-      return 1;
-    }
+#ifdef __SSE2__
+  // Docids fit in 31 bits, so signed comparisons are safe
+  __m128i key = _mm_set1_epi32(docid);
+  int mask = 0, i;
+  for(i = 0; i < SEARCH_CHUNK; i += 4) {
+    __m128i v = _mm_loadu_si128((__m128i*) &data[index + i]);
+    __m128i lt = reverse ? _mm_cmpgt_epi32(v, key) : _mm_cmplt_epi32(v, key);
+    mask |= _mm_movemask_ps(_mm_castsi128_ps(lt)) << i;
+  }
+  mask &= (1 << (end - index)) - 1;
+  return index + __builtin_popcount(mask);
+#else
+  while(index < end && LESS_THAN(data[index], docid, reverse)) {
+    index++;
+  }
+  return index;
+#endif
+}
 
-    int beginIndex = *index;
-    int hop = 0;
-    int tempIndex = beginIndex;
-    while(tempIndex < *count) {
-      if(LESS_THAN(data[tempIndex], docid, pool->reverse)) {
-        beginIndex = tempIndex;
-        hop = hop == 0 ? 1 : hop * 2;
-        tempIndex += hop;
-      } else {
-        break;
-      }
-    }
-    if(data[beginIndex] == docid) {
-      (*index) = beginIndex;
-      return 1;
-    }
+/**
+ * Moves the cursor (data, count, index, pointer) to the first docid
+ * that is not less than "docid." Blocks that end before "docid" are
+ * skipped using the docid stored in their header, without being
+ * decompressed.
+ *
+ * @return 0 if the list has been exhausted, 1 otherwise
+ */
+inline int gallopSearch(SegmentPool* pool, unsigned int* data, int* count,
+                        int* index, long* pointer, unsigned int docid) {
+  if(*index < *count && !LESS_THAN(data[*count - 1], docid, pool->reverse)) {
+    (*index) = lowerBound(data, *index, *count, docid, pool->reverse);
+    return 1;
+  }
 
-    int endIndex = *count - 1;
-    hop = 0;
-    tempIndex = endIndex;
-    while(tempIndex >= 0) {
-      if(GREATER_THAN(data[tempIndex], docid, pool->reverse)) {
-        endIndex = tempIndex;
-        hop = hop == 0 ? 1 : hop * 2;
-        tempIndex -= hop;
-      } else {
-        break;
-      }
-    }
-    if(data[endIndex] == docid) {
-      (*index) = endIndex;
-      return 1;
+  do {
+    (*pointer) = nextPointer(pool, *pointer);
+    if(*pointer == UNDEFINED_POINTER) {
+      return 0;
     }
+  } while(LESS_THAN(getMaxDocId(pool, *pointer), docid, pool->reverse));
 
-    // Binary search between begin and end indexes
-    int mid = beginIndex;
-    while(beginIndex < endIndex) {
-      mid = beginIndex + ((endIndex - beginIndex) / 2);
-
-      if(LESS_THAN(docid, data[mid], pool->reverse)) {
-        endIndex = mid - 1;
-      } else if(GREATER_THAN(docid, data[mid], pool->reverse)) {
-        beginIndex = mid + 1;
-      } else {
-        (*index) = mid;
-        return 1;
-      }
-    }
-    (*index) = endIndex;
-    if(*index < 0) {
-      (*index) = 0;
-    } else if(*index >= *count) {
-      (*index) = *count;
-      continue;
-    }
-    return 1;
-  }
+  (*count) = decompressDocidBlock(pool, data, *pointer);
+  (*index) = lowerBound(data, 0, *count, docid, pool->reverse);
+  return 1;
 }
 
-int* intersectPostingsLists_SvS(SegmentPool* pool, long a, long b, int minDf) {
-  int* set = (int*) calloc(minDf, sizeof(int));
-  unsigned int* dataA = (unsigned int*) calloc(BLOCK_SIZE * 2, sizeof(unsigned int));
-  unsigned int* dataB = (unsigned int*) calloc(BLOCK_SIZE * 2, sizeof(unsigned int));
+int* intersectPostingsLists_SvS(SegmentPool* pool, long a, long b, int minDf,
+                                QueryContext* context) {
+  int* set = (int*) allocateQueryContext(context, minDf * sizeof(int));
+  unsigned int* dataA = (unsigned int*)
+    allocateQueryContext(context, BLOCK_SIZE * 2 * sizeof(unsigned int));
+  unsigned int* dataB = (unsigned int*)
+    allocateQueryContext(context, BLOCK_SIZE * 2 * sizeof(unsigned int));
 
   int cA = decompressDocidBlock(pool, dataA, a);
   int cB = decompressDocidBlock(pool, dataB, b);
   int iSet = 0, iA = 0, iB = 0;
 
-  while(a != UNDEFINED_POINTER && b != UNDEFINED_POINTER && iSet < minDf) {
-    if(dataB[iB] == dataA[iA]) {
-      set[iSet++] = dataA[iA];
-      iA++;
-      iB++;
+  // Leapfrog: each list gallops to the current docid of the other one
+  while(iSet < minDf) {
+    if(!gallopSearch(pool, dataB, &cB, &iB, &b, dataA[iA])) {
+      break;
+    }
+    if(isBitmapContainer(pool, a) && isBitmapContainer(pool, b)) {
+      // Both segments are dense: AND their bitmaps word by word,
+      // up to the end of the segment that ends first
+      unsigned int last = LESS_THAN(dataA[cA - 1], dataB[cB - 1], pool->reverse) ?
+        dataA[cA - 1] : dataB[cB - 1];
+      iSet += intersectBitmapContainers(getDocidBlock(pool, a), getDocidBlock(pool, b),
+                                        dataA[iA], last, pool->reverse,
+                                        &set[iSet], minDf - iSet);
+      // Move both cursors past "last"
+      iA = lowerBound(dataA, iA, cA, last, pool->reverse);
+      if(iA < cA && dataA[iA] == last) {
+        iA++;
+      }
+      iB = lowerBound(dataB, iB, cB, last, pool->reverse);
+      if(iB < cB && dataB[iB] == last) {
+        iB++;
+      }
       if(iA == cA) {
         a = nextPointer(pool, a);
         if(a == UNDEFINED_POINTER) {
           break;
         }
-        memset(dataA, 0, BLOCK_SIZE * 2 * sizeof(unsigned int));
         cA = decompressDocidBlock(pool, dataA, a);
         iA = 0;
       }
-      if(iB == cB) {
-        b = nextPointer(pool, b);
-        if(b == UNDEFINED_POINTER) {
-          break;
-        }
-        memset(dataB, 0, BLOCK_SIZE * 2 * sizeof(unsigned int));
-        cB = decompressDocidBlock(pool, dataB, b);
-        iB = 0;
-      }
+      continue;
     }
-
-    if(LESS_THAN(dataA[iA], dataB[iB], pool->reverse)) {
+    if(dataB[iB] == dataA[iA]) {
+      set[iSet++] = dataA[iA];
       iA++;
-      if(!gallopSearch(pool, dataA, &cA, &iA, &a, dataB[iB])) {
-        break;
-      }
-    } else if(LESS_THAN(dataB[iB], dataA[iA], pool->reverse)) {
-      iB++;
-      if(!gallopSearch(pool, dataB, &cB, &iB, &b, dataA[iA])) {
-        break;
-      }
+    }
+    if(!gallopSearch(pool, dataA, &cA, &iA, &a, dataB[iB])) {
+      break;
     }
   }
 
   if(iSet < minDf) {
     set[iSet] = TERMINAL_DOCID;
   }
-
-  free(dataA);
-  free(dataB);
-
   return set;
 }
 
-int intersectSetPostingsList_SvS(SegmentPool* pool, long a, int* currentSet, int len) {
-  unsigned int* data = (unsigned int*) calloc(BLOCK_SIZE * 2, sizeof(unsigned int));
-  int c = decompressDocidBlock(pool, data, a);
-  int iSet = 0, iCurrent = 0, i = 0;
-
-  while(a != UNDEFINED_POINTER && iCurrent < len) {
-    if(currentSet[iCurrent] == TERMINAL_DOCID) {
+int intersectSetPostingsList_SvS(SegmentPool* pool, long a, int* currentSet, int len,
+                                 QueryContext* context) {
+  unsigned int* data = (unsigned int*)
+    allocateQueryContext(context, BLOCK_SIZE * 2 * sizeof(unsigned int));
+  // Segment whose docids are decoded in "data"
+  long decoded = UNDEFINED_POINTER;
+  int iSet = 0, iCurrent = 0, i = 0, c = 0;
+
+  for(iCurrent = 0; iCurrent < len && currentSet[iCurrent] != TERMINAL_DOCID; iCurrent++) {
+    unsigned int docid = currentSet[iCurrent];
+    a = seekSegment(pool, NULL, a, docid);
+    if(a == UNDEFINED_POINTER) {
       break;
     }
-    if(data[i] == currentSet[iCurrent]) {
-      currentSet[iSet++] = currentSet[iCurrent];
-      iCurrent++;
-      i++;
-
-      if(i == c) {
-        a = nextPointer(pool, a);
-        if(a == UNDEFINED_POINTER) {
-          break;
-        }
-        memset(data, 0, BLOCK_SIZE * 2 * sizeof(unsigned int));
-        c = decompressDocidBlock(pool, data, a);
-        i = 0;
-      }
-      if(iCurrent == len) {
-        break;
-      }
-      if(currentSet[iCurrent] == TERMINAL_DOCID) {
-        break;
+    // Dense segments are probed with a bit test, without being decoded
+    if(isBitmapContainer(pool, a)) {
+      if(containsBitmapContainer(getDocidBlock(pool, a), docid)) {
+        currentSet[iSet++] = docid;
       }
+      continue;
     }
-
-    if(LESS_THAN(data[i], currentSet[iCurrent], pool->reverse)) {
-      i++;
-      if(!gallopSearch(pool, data, &c, &i, &a, currentSet[iCurrent])) {
-        break;
-      }
-    } else {
-      while(LESS_THAN(currentSet[iCurrent], data[i], pool->reverse)) {
-        iCurrent++;
-        if(iCurrent == len) {
-          break;
-        }
-        if(currentSet[iCurrent] == TERMINAL_DOCID) {
-          break;
-        }
-      }
+    if(a != decoded) {
+      c = decompressDocidBlock(pool, data, a);
+      decoded = a;
+      i = 0;
+    }
+    i = lowerBound(data, i, c, docid, pool->reverse);
+    if(data[i] == docid) {
+      currentSet[iSet++] = docid;
     }
   }
 
   if(iSet < len) {
     currentSet[iSet] = TERMINAL_DOCID;
   }
-
-  free(data);
   return iSet;
 }
 
-int* intersectSvS(SegmentPool* pool, long* headPointers, int len, int minDf, int hits) {
+int* intersectSvS(SegmentPool* pool, long* headPointers, int len, int minDf, int hits,
+                  QueryContext* context) {
   if(len < 2) {
-    unsigned int* block = (unsigned int*) calloc(BLOCK_SIZE * 2, sizeof(unsigned int));
+    unsigned int* block = (unsigned int*)
+      allocateQueryContext(context, BLOCK_SIZE * 2 * sizeof(unsigned int));
     int length = MIN(minDf, hits);
-    int* set = (int*) calloc(length, sizeof(int));
+    int* set = (int*) allocateQueryContext(context, length * sizeof(int));
     int iSet = 0;
     long t = headPointers[0];
     while(t != UNDEFINED_POINTER && iSet < length) {
-      memset(block, 0, BLOCK_SIZE * 2 * sizeof(unsigned int));
       int c = decompressDocidBlock(pool, block, t);
       int r = iSet + c <= length ? c : length - iSet;
       memcpy(&set[iSet], block, r * sizeof(int));
       iSet += r;
       t = nextPointer(pool, t);
     }
-    free(block);
     return set;
   } else if(len == 2) {
-    return intersectPostingsLists_SvS(pool, headPointers[0], headPointers[1], MIN(minDf, hits));
+    return intersectPostingsLists_SvS(pool, headPointers[0], headPointers[1],
+                                      MIN(minDf, hits), context);
   }
 
-  int* set = intersectPostingsLists_SvS(pool, headPointers[0], headPointers[1], minDf);
+  int* set = intersectPostingsLists_SvS(pool, headPointers[0], headPointers[1],
+                                        minDf, context);
   int i;
   for(i = 2; i < len; i++) {
     if(set[0] == TERMINAL_DOCID) {
       break;
     }
-    intersectSetPostingsList_SvS(pool, headPointers[i], set, minDf);
+    intersectSetPostingsList_SvS(pool, headPointers[i], set, minDf, context);
   }
   return set;
 }
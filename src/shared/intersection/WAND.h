@@ -7,48 +7,73 @@
 #include "heap/Heap.h"
 #include "scorer/BM25.h"
 #include "SegmentPool.h"
+#include "QueryContext.h"
+#include "intersection/SvS.h"
 
 #define MIN(X, Y) (X < Y ? X : Y)
 #define TERMINAL_DOCID -1
 
+/**
+ * Orders cursors by their current docid, breaking ties by term, so that
+ * scores are always summed in the same order. This is an insertion sort
+ * over the cached docids: between two pivot steps only the cursors that
+ * have been advanced are out of place, so it runs in close to linear time.
+ *
+ * @param mapping Cursor order (indexes into curDocid)
+ * @param curDocid Current docid of each cursor
+ * @param len Number of live cursors
+ * @param reverse Whether postings are stored backwards
+ */
+void sortCursors(int* mapping, unsigned int* curDocid, int len, int reverse) {
+  int i, j;
+  for(i = 1; i < len; i++) {
+    int term = mapping[i];
+    unsigned int docid = curDocid[term];
+    for(j = i - 1; j >= 0; j--) {
+      unsigned int other = curDocid[mapping[j]];
+      if(!(GREATER_THAN(other, docid, reverse) ||
+           (other == docid && mapping[j] > term))) {
+        break;
+      }
+      mapping[j + 1] = mapping[j];
+    }
+    mapping[j + 1] = term;
+  }
+}
+
 int* wand(SegmentPool* pool, long* headPointers, int* df, float* UB, int len,
           int* docLen, int totalDocs, float avgDocLen, int hits, int microblog,
-          float** scores) {
-  Heap* elements = initHeap(hits);
-  int origLen = len;
-  unsigned int** blockDocid = (unsigned int**) calloc(len, sizeof(unsigned int*));
-  unsigned int** blockTf = (unsigned int**) calloc(len, sizeof(unsigned int*));
-  unsigned int* counts = (unsigned int*) calloc(len, sizeof(unsigned int));
-  int* posting = (int*) calloc(len, sizeof(int));
-  int* mapping = (int*) calloc(len, sizeof(int));
+          float** scores, QueryContext* context) {
+  Heap* elements = getHeapQueryContext(context, hits);
+  unsigned int** blockDocid = (unsigned int**)
+    allocateQueryContext(context, len * sizeof(unsigned int*));
+  unsigned int** blockTf = (unsigned int**)
+    allocateQueryContext(context, len * sizeof(unsigned int*));
+  unsigned int* counts = (unsigned int*) allocateQueryContext(context, len * sizeof(unsigned int));
+  // Whether the tf block of each cursor's current segment has been decoded
+  int* tfDecoded = (int*) allocateQueryContext(context, len * sizeof(int));
+  int* posting = (int*) allocateQueryContext(context, len * sizeof(int));
+  int* mapping = (int*) allocateQueryContext(context, len * sizeof(int));
+  unsigned int* curDocid = (unsigned int*)
+    allocateQueryContext(context, len * sizeof(unsigned int));
   float threshold = 0;
 
-  int i, j;
+  int i;
   for(i = 0; i < len; i++) {
-    blockDocid[i] = (unsigned int*) calloc(BLOCK_SIZE * 2, sizeof(unsigned int));
-    blockTf[i] = microblog ? NULL : (unsigned int*) calloc(BLOCK_SIZE * 2, sizeof(unsigned int));
+    blockDocid[i] = (unsigned int*)
+      allocateQueryContext(context, BLOCK_SIZE * 2 * sizeof(unsigned int));
+    blockTf[i] = microblog ? NULL : (unsigned int*)
+      allocateQueryContext(context, BLOCK_SIZE * 2 * sizeof(unsigned int));
     counts[i] = decompressDocidBlock(pool, blockDocid[i], headPointers[i]);
-    if(!microblog) {
-      decompressTfBlock(pool, blockTf[i], headPointers[i]);
-    }
     posting[i] = 0;
     mapping[i] = i;
+    curDocid[i] = blockDocid[i][0];
     if(UB[i] <= threshold) {
       threshold = UB[i] - 1;
     }
   }
 
-  for(i = 0; i < len; i++) {
-    for(j = i + 1; j < len; j++) {
-      if(GREATER_THAN(blockDocid[mapping[i]][posting[mapping[i]]],
-                      blockDocid[mapping[j]][posting[mapping[j]]],
-                      pool->reverse)) {
-        int temp = mapping[i];
-        mapping[i] = mapping[j];
-        mapping[j] = temp;
-      }
-    }
-  }
+  sortCursors(mapping, curDocid, len, pool->reverse);
 
   int curDoc = 0;
   int pTerm = 0;
@@ -64,8 +89,7 @@ int* wand(SegmentPool* pool, long* headPointers, int* df, float* UB, int len,
         pTerm = mapping[i];
         pTermIdx = i;
         if(i < len - 1) {
-          if(blockDocid[mapping[i]][posting[mapping[i]]] ==
-             blockDocid[mapping[i + 1]][posting[mapping[i + 1]]]) {
+          if(curDocid[mapping[i]] == curDocid[mapping[i + 1]]) {
             continue;
           }
         }
@@ -77,14 +101,19 @@ int* wand(SegmentPool* pool, long* headPointers, int* df, float* UB, int len,
       break;
     }
 
-    int pivot = blockDocid[pTerm][posting[pTerm]];
+    int pivot = curDocid[pTerm];
 
-    if(blockDocid[mapping[0]][posting[mapping[0]]] == pivot) {
+    if(curDocid[mapping[0]] == pivot) {
       curDoc = pivot;
       if(pivot != 0) {
         float score = 0;
         if(!microblog) {
           for(i = 0; i <= pTermIdx; i++) {
+            // Term frequencies are only decoded for blocks that get scored
+            if(!tfDecoded[mapping[i]]) {
+              decompressTfBlock(pool, blockTf[mapping[i]], headPointers[mapping[i]]);
+              tfDecoded[mapping[i]] = 1;
+            }
             score += _default_bm25(blockTf[mapping[i]][posting[mapping[i]]],
                                    df[mapping[i]], totalDocs, docLen[curDoc], avgDocLen);
           }
@@ -118,6 +147,7 @@ int* wand(SegmentPool* pool, long* headPointers, int* df, float* UB, int len,
           }
           len--;
           atermIdx--;
+          pTermIdx--;
           continue;
         }
 
@@ -129,20 +159,37 @@ int* wand(SegmentPool* pool, long* headPointers, int* df, float* UB, int len,
               break;
             } else {
               counts[aterm] = decompressDocidBlock(pool, blockDocid[aterm], headPointers[aterm]);
-              if(!microblog) {
-                decompressTfBlock(pool, blockTf[aterm], headPointers[aterm]);
-              }
+              tfDecoded[aterm] = 0;
               posting[aterm] = 0;
             }
           }
         }
+
+        // The list has run out: drop the cursor
+        if(headPointers[aterm] == UNDEFINED_POINTER) {
+          int k = 0;
+          for(i = 0; i < len; i++) {
+            if(i != atermIdx) {
+              mapping[k++] = mapping[i];
+            }
+          }
+          len--;
+          atermIdx--;
+          pTermIdx--;
+          continue;
+        }
+        curDocid[aterm] = blockDocid[aterm][posting[aterm]];
       }
+
     } else {
-      int aterm = mapping[0];
+      // Advance the cursor with the smallest df among those before the
+      // pivot. Cursors on their last posting cannot reach the pivot, and are
+      // dropped instead; if all of them are, there is nothing to advance.
+      int aterm = -1;
       int atermIdx;
       for(atermIdx = 0; atermIdx < MIN(pTermIdx + 1, len); atermIdx++) {
-        if(df[mapping[atermIdx]] <= df[aterm] &&
-           LESS_THAN(blockDocid[mapping[atermIdx]][posting[mapping[atermIdx]]], pivot, pool->reverse)) {
+        if((aterm == -1 || df[mapping[atermIdx]] <= df[aterm]) &&
+           LESS_THAN(curDocid[mapping[atermIdx]], pivot, pool->reverse)) {
           int atermTemp = mapping[atermIdx];
 
           if(posting[atermTemp] >= counts[atermTemp] - 1 &&
@@ -155,62 +202,52 @@ int* wand(SegmentPool* pool, long* headPointers, int* df, float* UB, int len,
             }
             len--;
             atermIdx--;
+            pTermIdx--;
             continue;
           }
           aterm = atermTemp;
         }
       }
+      if(aterm == -1) {
+        continue;
+      }
 
-      while(LESS_THAN(blockDocid[aterm][posting[aterm]], pivot, pool->reverse)) {
-        posting[aterm]++;
-        if(posting[aterm] > counts[aterm] - 1) {
-          headPointers[aterm] = nextPointer(pool, headPointers[aterm]);
-          if(headPointers[aterm] == UNDEFINED_POINTER) {
-            break;
-          } else {
-            counts[aterm] = decompressDocidBlock(pool, blockDocid[aterm], headPointers[aterm]);
-            if(!microblog) {
-              decompressTfBlock(pool, blockTf[aterm], headPointers[aterm]);
-            }
-            posting[aterm] = 0;
-          }
+      // Skip to the pivot. Blocks that end before the pivot are skipped
+      // using their header, and are never decompressed.
+      long pointer = headPointers[aterm];
+      int count = counts[aterm], index = posting[aterm];
+      if(gallopSearch(pool, blockDocid[aterm], &count, &index,
+                      &headPointers[aterm], pivot)) {
+        if(headPointers[aterm] != pointer) {
+          tfDecoded[aterm] = 0;
         }
+        counts[aterm] = count;
+        posting[aterm] = index;
       }
-    }
 
-    for(i = 0; i < len; i++) {
-      for(j = i + 1; j < len; j++) {
-        if(GREATER_THAN(blockDocid[mapping[i]][posting[mapping[i]]],
-                        blockDocid[mapping[j]][posting[mapping[j]]],
-                        pool->reverse)) {
-          int temp = mapping[i];
-          mapping[i] = mapping[j];
-          mapping[j] = temp;
+      // The list has run out: drop the cursor
+      if(headPointers[aterm] == UNDEFINED_POINTER) {
+        int k = 0;
+        for(i = 0; i < len; i++) {
+          if(mapping[i] != aterm) {
+            mapping[k++] = mapping[i];
+          }
         }
+        len = k;
+      } else {
+        curDocid[aterm] = blockDocid[aterm][posting[aterm]];
       }
     }
-  }
 
-  // Free the allocated memory
-  free(posting);
-  free(mapping);
-  for(i = 0; i < origLen; i++) {
-    free(blockDocid[i]);
-    if(blockTf[i]) {
-      free(blockTf[i]);
-    }
+    sortCursors(mapping, curDocid, len, pool->reverse);
   }
-  free(blockDocid);
-  free(blockTf);
-  free(counts);
 
-  int* set = (int*) calloc(elements->index + 1, sizeof(int));
+  int* set = (int*) allocateQueryContext(context, (elements->index + 1) * sizeof(int));
   memcpy(set, &elements->docid[1], elements->index * sizeof(int));
   memcpy(*scores, &elements->score[1], elements->index * sizeof(float));
   if(!isFullHeap(elements)) {
     set[elements->index] = TERMINAL_DOCID;
   }
-  destroyHeap(elements);
   return set;
 }
 
@@ -0,0 +1,191 @@
+/**
+ * Cascade evaluation of a tree ensemble, for when only the top k
+ * instances are returned. Trees are evaluated with VPred, a segment of
+ * trees at a time; at the checkpoint after each segment, instances that
+ * can no longer make it into the top k are dropped, and the remaining
+ * trees are only evaluated for the rest.
+ *
+ * The final score of an instance lies between its partial score plus
+ * the smallest leaf values of the remaining trees, and its partial score
+ * plus their largest leaf values. The k-th largest lower bound is a lower
+ * bound on the final score of the k-th result, and an instance is dropped
+ * when its upper bound falls below it. The top k are therefore the same
+ * as with a full evaluation, and so are their scores.
+ *
+ *   Cascade* cascade = createCascade(model, k, interval);
+ *   n = scoreCascade(cascade, model, features, numberOfFeatures,
+ *                    numberOfInstances, set, scores);
+ *   destroyCascade(cascade);
+ */
+
+#ifndef CASCADE_H_GUARD
+#define CASCADE_H_GUARD
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include "heap/Heap.h"
+#include "TreeBuilder.h"
+
+// Default number of trees between two checkpoints
+#define DEFAULT_CASCADE_INTERVAL 100
+
+typedef struct Cascade Cascade;
+
+struct Cascade {
+  // Number of instances to keep
+  int k;
+
+  // Checkpoint c follows tree checkpoints[c] - 1
+  int numberOfCheckpoints;
+  int* checkpoints;
+  // Sums of the smallest and largest leaf values of the trees after
+  // checkpoint c
+  double* minRemaining;
+  double* maxRemaining;
+
+  // Lower bounds of the top k instances
+  Heap* heap;
+
+  // Number of (instance, tree) pairs evaluated so far, in blocks of V instances
+  long evaluations;
+};
+
+/**
+ * Finds the smallest and largest leaf values of a subtree.
+ */
+void findLeafBounds(Node* nodes, int i, float* min, float* max) {
+  if(nodes[i].children[0] == i && nodes[i].children[1] == i) {
+    if(nodes[i].theta < *min) *min = nodes[i].theta;
+    if(nodes[i].theta > *max) *max = nodes[i].theta;
+    return;
+  }
+  findLeafBounds(nodes, nodes[i].children[0], min, max);
+  findLeafBounds(nodes, nodes[i].children[1], min, max);
+}
+
+/**
+ * @param model Tree ensemble
+ * @param k Number of instances to keep
+ * @param interval Number of trees between two checkpoints
+ */
+Cascade* createCascade(TreeModel* model, int k, int interval) {
+  Cascade* cascade = (Cascade*) malloc(sizeof(Cascade));
+  cascade->k = k;
+  cascade->numberOfCheckpoints = (model->nbTrees - 1) / interval;
+  cascade->checkpoints = (int*) malloc((cascade->numberOfCheckpoints + 1) * sizeof(int));
+  cascade->minRemaining = (double*) malloc((cascade->numberOfCheckpoints + 1) * sizeof(double));
+  cascade->maxRemaining = (double*) malloc((cascade->numberOfCheckpoints + 1) * sizeof(double));
+  cascade->heap = initHeap(k);
+  cascade->evaluations = 0;
+
+  // The last "checkpoint" is the end of the ensemble, after which no tree remains
+  int c, t;
+  double minSum = 0, maxSum = 0;
+  cascade->checkpoints[cascade->numberOfCheckpoints] = model->nbTrees;
+  c = cascade->numberOfCheckpoints;
+  for(t = model->nbTrees - 1; c > 0; t--) {
+    float min = FLT_MAX, max = -FLT_MAX;
+    findLeafBounds(&model->nodes[model->nodeSizes[t]], 0, &min, &max);
+    minSum += min;
+    maxSum += max;
+    if(t == c * interval) {
+      c--;
+      cascade->checkpoints[c] = t;
+      cascade->minRemaining[c] = minSum;
+      cascade->maxRemaining[c] = maxSum;
+    }
+  }
+  return cascade;
+}
+
+void destroyCascade(Cascade* cascade) {
+  free(cascade->checkpoints);
+  free(cascade->minRemaining);
+  free(cascade->maxRemaining);
+  destroyHeap(cascade->heap);
+  free(cascade);
+}
+
+/**
+ * Adds the scores of trees from, ..., to - 1 to the scores of instances,
+ * V instances at a time (see findLeaf).
+ */
+void scoreTreesVPred(TreeModel* model, int from, int to, float* features,
+                     int numberOfFeatures, int numberOfInstances, float* scores) {
+  int leaf[V];
+  int i, t, j;
+  for(i = 0; i < numberOfInstances; i += V) {
+    for(t = from; t < to; t++) {
+      Node* nodes = &model->nodes[model->nodeSizes[t]];
+      findLeaf[model->treeDepths[t]](leaf, &features[i * numberOfFeatures],
+                                     numberOfFeatures, nodes);
+      for(j = 0; j < V; j++) {
+        scores[i + j] += nodes[leaf[j]].theta;
+      }
+    }
+  }
+}
+
+/**
+ * Scores instances with the ensemble, dropping those that cannot make it
+ * into the top k along the way. The remaining instances are moved to the
+ * front of features, set and scores, in their original order, and the
+ * rest of set is cleared.
+ *
+ * As with findLeaf, features and scores must have room for
+ * numberOfInstances rounded up to a multiple of V.
+ *
+ * @param cascade Cascade of the ensemble
+ * @param model Tree ensemble
+ * @param features Feature values, numberOfFeatures per instance
+ * @param numberOfFeatures Number of features of an instance
+ * @param numberOfInstances Number of instances
+ * @param set Document ids of the instances
+ * @param scores Output scores, one per instance
+ * @return The number of remaining instances
+ */
+int scoreCascade(Cascade* cascade, TreeModel* model, float* features, int numberOfFeatures,
+                 int numberOfInstances, int* set, float* scores) {
+  int i, n = numberOfInstances, c, from = 0;
+  memset(scores, 0, ((n + V - 1) / V) * V * sizeof(float));
+
+  for(c = 0; c <= cascade->numberOfCheckpoints; c++) {
+    scoreTreesVPred(model, from, cascade->checkpoints[c], features,
+                    numberOfFeatures, n, scores);
+    cascade->evaluations += (long) ((n + V - 1) / V) * V * (cascade->checkpoints[c] - from);
+    from = cascade->checkpoints[c];
+    if(c == cascade->numberOfCheckpoints || n <= cascade->k) {
+      continue;
+    }
+
+    // Lower bound on the final score of the k-th instance
+    clearHeap(cascade->heap);
+    for(i = 0; i < n; i++) {
+      insertHeap(cascade->heap, i, scores[i] + cascade->minRemaining[c]);
+    }
+    double threshold = minScoreHeap(cascade->heap);
+
+    int remaining = 0;
+    for(i = 0; i < n; i++) {
+      if(scores[i] + cascade->maxRemaining[c] < threshold) {
+        continue;
+      }
+      if(remaining != i) {
+        memcpy(&features[(long) remaining * numberOfFeatures],
+               &features[(long) i * numberOfFeatures], numberOfFeatures * sizeof(float));
+        set[remaining] = set[i];
+        scores[remaining] = scores[i];
+      }
+      remaining++;
+    }
+    n = remaining;
+  }
+
+  for(i = n; i < numberOfInstances; i++) {
+    set[i] = 0;
+  }
+  return n;
+}
+
+#endif
@@ -0,0 +1,341 @@
+/**
+ * Runtime-compiled tree ensembles. A loaded model is turned into C code
+ * with the feature ids, thresholds and children of every tree baked into
+ * constant tables, and one function per tree whose depth is a constant.
+ * The code is compiled with the local C compiler into a shared object,
+ * which is then loaded with dlopen. Shared objects are cached on disk
+ * under the hash of the model, so a stable model is only compiled once.
+ *
+ * Scores are identical to those of VPred (findLeaf): trees go right when
+ * the feature value is greater than the threshold, thresholds and leaf
+ * values are written as exact (hexadecimal) float literals, and tree
+ * scores are added up in the same order.
+ *
+ *   CompiledModel* compiled = createCompiledModel(model, cacheDirectory);
+ *   if(compiled) {
+ *     scoreCompiledModel(compiled, features, numberOfFeatures,
+ *                        numberOfInstances, scores);
+ *     destroyCompiledModel(compiled);
+ *   }
+ */
+
+#ifndef COMPILED_MODEL_H_GUARD
+#define COMPILED_MODEL_H_GUARD
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "TreeBuilder.h"
+
+// Compiler command, and the flags used to build a shared object (one
+// string per argument)
+#define COMPILED_MODEL_COMPILER "gcc"
+#define COMPILED_MODEL_FLAGS "-O2", "-shared", "-fPIC"
+// Default directory of cached shared objects, relative to $HOME
+#define DEFAULT_COMPILED_MODEL_CACHE ".zambezi-models"
+// Version of the generated code, part of the hash of a model, so that
+// changes to the code generator invalidate cached shared objects
+#define COMPILED_MODEL_VERSION 1
+
+typedef void (*scoreCompiledInstances)(float* features, int numberOfFeatures,
+                                       int numberOfInstances, float* scores);
+
+typedef struct CompiledModel CompiledModel;
+
+struct CompiledModel {
+  // Handle of the shared object, and its scoring function
+  void* handle;
+  scoreCompiledInstances score;
+  unsigned long hash;
+};
+
+/**
+ * Counts the nodes of a subtree.
+ */
+long countCompiledNodes(Node* nodes, int i) {
+  if(nodes[i].children[0] == i && nodes[i].children[1] == i) {
+    return 1;
+  }
+  return 1 + countCompiledNodes(nodes, nodes[i].children[0]) +
+    countCompiledNodes(nodes, nodes[i].children[1]);
+}
+
+/**
+ * Hashes a model (FNV-1a over the structure of every tree), to name
+ * its compiled code.
+ */
+unsigned long hashTreeModel(TreeModel* model) {
+  unsigned long hash = (14695981039346656037UL ^ COMPILED_MODEL_VERSION) * 1099511628211UL;
+  int t;
+  long i;
+  for(t = 0; t < model->nbTrees; t++) {
+    Node* nodes = &model->nodes[model->nodeSizes[t]];
+    long size = countCompiledNodes(nodes, 0);
+    unsigned char* bytes = (unsigned char*) nodes;
+    for(i = 0; i < size * (long) sizeof(Node); i++) {
+      hash = (hash ^ bytes[i]) * 1099511628211UL;
+    }
+    // Separate trees, so that moving a node across trees changes the hash
+    hash = (hash ^ 0xFF) * 1099511628211UL;
+  }
+  return hash;
+}
+
+/**
+ * Writes the code of a tree: its nodes, as constant tables, and a
+ * function that moves V instances down the tree at once, one level at
+ * a time. The depth of the tree is a constant, so the compiler unrolls
+ * the levels, and every step is a branch-free table lookup, as in
+ * VPred. Leaves point to themselves, so instances that reach a leaf
+ * early stay there.
+ */
+void writeCompiledTree(FILE* fp, Node* nodes, int t, int depth) {
+  long i, size = countCompiledNodes(nodes, 0);
+  fprintf(fp, "static const int fid%d[] = {", t);
+  for(i = 0; i < size; i++) {
+    fprintf(fp, "%s%d", i ? ", " : "", nodes[i].fid);
+  }
+  fprintf(fp, "};\nstatic const float theta%d[] = {", t);
+  for(i = 0; i < size; i++) {
+    fprintf(fp, "%s%af", i ? ", " : "", nodes[i].theta);
+  }
+  fprintf(fp, "};\nstatic const int children%d[][2] = {", t);
+  for(i = 0; i < size; i++) {
+    fprintf(fp, "%s{%d, %d}", i ? ", " : "", nodes[i].children[0], nodes[i].children[1]);
+  }
+  fprintf(fp, "};\n\n");
+
+  fprintf(fp, "static void tree%d(const float* x, int numberOfFeatures, int m, float* scores) {\n", t);
+  fprintf(fp, "  int l[V] = {0}, d, j;\n");
+  fprintf(fp, "  for(d = 0; d < %d; d++) {\n", depth);
+  fprintf(fp, "    for(j = 0; j < V; j++) {\n");
+  fprintf(fp, "      l[j] = children%d[l[j]][x[j * numberOfFeatures + fid%d[l[j]]] > theta%d[l[j]]];\n",
+          t, t, t);
+  fprintf(fp, "    }\n");
+  fprintf(fp, "  }\n");
+  fprintf(fp, "  for(j = 0; j < m; j++) {\n");
+  fprintf(fp, "    scores[j] += theta%d[l[j]];\n", t);
+  fprintf(fp, "  }\n");
+  fprintf(fp, "}\n\n");
+}
+
+/**
+ * Writes the C code of a model: one function per tree, and
+ * scoreCompiledTrees, which scores instances V at a time, tree by tree.
+ * Blocks of fewer than V instances are padded with copies of their last
+ * instance, whose scores are dropped.
+ */
+void writeCompiledModelSource(TreeModel* model, unsigned long hash, FILE* fp) {
+  int t;
+  fprintf(fp, "#define V %d\n\n", V);
+  fprintf(fp, "const unsigned long compiledModelHash = %luUL;\n\n", hash);
+  for(t = 0; t < model->nbTrees; t++) {
+    writeCompiledTree(fp, &model->nodes[model->nodeSizes[t]], t, model->treeDepths[t]);
+  }
+  fprintf(fp, "void scoreCompiledTrees(float* features, int numberOfFeatures,\n");
+  fprintf(fp, "                        int numberOfInstances, float* scores) {\n");
+  fprintf(fp, "  int i, j, f, m;\n");
+  fprintf(fp, "  for(i = 0; i < numberOfInstances; i += V) {\n");
+  fprintf(fp, "    m = numberOfInstances - i < V ? numberOfInstances - i : V;\n");
+  fprintf(fp, "    const float* x = &features[(long) i * numberOfFeatures];\n");
+  fprintf(fp, "    float padded[m < V ? V * numberOfFeatures : 1];\n");
+  fprintf(fp, "    if(m < V) {\n");
+  fprintf(fp, "      for(j = 0; j < V; j++) {\n");
+  fprintf(fp, "        for(f = 0; f < numberOfFeatures; f++) {\n");
+  fprintf(fp, "          padded[j * numberOfFeatures + f] = x[(j < m ? j : m - 1) * numberOfFeatures + f];\n");
+  fprintf(fp, "        }\n");
+  fprintf(fp, "      }\n");
+  fprintf(fp, "      x = padded;\n");
+  fprintf(fp, "    }\n");
+  fprintf(fp, "    for(j = 0; j < m; j++) {\n");
+  fprintf(fp, "      scores[i + j] = 0;\n");
+  fprintf(fp, "    }\n");
+  for(t = 0; t < model->nbTrees; t++) {
+    fprintf(fp, "    tree%d(x, numberOfFeatures, m, &scores[i]);\n", t);
+  }
+  fprintf(fp, "  }\n");
+  fprintf(fp, "}\n");
+}
+
+/**
+ * Loads a compiled model, and checks that it was compiled from a model
+ * with the given hash.
+ *
+ * @return 1 on success, 0 otherwise
+ */
+int loadCompiledModel(CompiledModel* compiled, char* path) {
+  compiled->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if(!compiled->handle) {
+    return 0;
+  }
+  unsigned long* hash = (unsigned long*) dlsym(compiled->handle, "compiledModelHash");
+  compiled->score = (scoreCompiledInstances) dlsym(compiled->handle, "scoreCompiledTrees");
+  if(!hash || *hash != compiled->hash || !compiled->score) {
+    dlclose(compiled->handle);
+    compiled->handle = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Compiles a source file into a shared object. The compiler is run
+ * directly, not through the shell, so paths are never interpreted.
+ *
+ * @return 1 on success, 0 otherwise
+ */
+int runCompiledModelCompiler(char* sourcePath, char* objectPath) {
+  char* argv[] = { COMPILED_MODEL_COMPILER, COMPILED_MODEL_FLAGS,
+                   "-o", objectPath, sourcePath, NULL };
+  pid_t pid = fork();
+  if(pid < 0) {
+    return 0;
+  }
+  if(pid == 0) {
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  int status;
+  while(waitpid(pid, &status, 0) < 0) {
+    if(errno != EINTR) {
+      return 0;
+    }
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Whether a file or directory is owned by the current user, and not
+ * writable by its group or by others.
+ */
+int isPrivateCompiledModelPath(struct stat* st) {
+  return st->st_uid == geteuid() && !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+/**
+ * Creates the cache directory (mode 0700) if it does not exist, and
+ * checks that it is private.
+ *
+ * @return 1 if the directory can be used, 0 otherwise
+ */
+int openCompiledModelCache(char* cacheDirectory) {
+  struct stat st;
+  if(mkdir(cacheDirectory, 0700) != 0 && errno != EEXIST) {
+    return 0;
+  }
+  if(stat(cacheDirectory, &st) != 0 || !S_ISDIR(st.st_mode) ||
+     !isPrivateCompiledModelPath(&st)) {
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Compiles a model, or loads it from the cache if it has already been
+ * compiled.
+ *
+ * @param model Tree ensemble
+ * @param cacheDirectory Directory of compiled models, or NULL for
+ *        $HOME/DEFAULT_COMPILED_MODEL_CACHE
+ * @return The compiled model, or NULL if it could not be compiled or loaded
+ */
+CompiledModel* createCompiledModel(TreeModel* model, char* cacheDirectory) {
+  char directory[1024];
+  if(!cacheDirectory) {
+    char* home = getenv("HOME");
+    if(!home) {
+      return NULL;
+    }
+    if(snprintf(directory, sizeof(directory), "%s/%s",
+                home, DEFAULT_COMPILED_MODEL_CACHE) >= (int) sizeof(directory)) {
+      return NULL;
+    }
+    cacheDirectory = directory;
+  }
+  if(!openCompiledModelCache(cacheDirectory)) {
+    return NULL;
+  }
+
+  // Paths that do not fit are not truncated, which could make them
+  // point elsewhere; the model is not compiled instead
+  unsigned long hash = hashTreeModel(model);
+  char path[1024], sourcePath[1024], objectPath[1024];
+  if(snprintf(path, sizeof(path), "%s/zambezi-model-%016lx.so",
+              cacheDirectory, hash) >= (int) sizeof(path) ||
+     snprintf(sourcePath, sizeof(sourcePath), "%s/zambezi-model-XXXXXX.c",
+              cacheDirectory) >= (int) sizeof(sourcePath) ||
+     snprintf(objectPath, sizeof(objectPath), "%s/zambezi-model-XXXXXX.so",
+              cacheDirectory) >= (int) sizeof(objectPath)) {
+    return NULL;
+  }
+
+  CompiledModel* compiled = (CompiledModel*) calloc(1, sizeof(CompiledModel));
+  compiled->hash = hash;
+
+  struct stat st;
+  if(!lstat(path, &st) && S_ISREG(st.st_mode) && isPrivateCompiledModelPath(&st) &&
+     loadCompiledModel(compiled, path)) {
+    return compiled;
+  }
+
+  // Compile into new temporary files, then move the shared object into
+  // place, so that concurrent processes never load a partial file
+  int sourceFd = mkstemps(sourcePath, 2);
+  if(sourceFd < 0) {
+    free(compiled);
+    return NULL;
+  }
+  int objectFd = mkstemps(objectPath, 3);
+  if(objectFd < 0) {
+    close(sourceFd);
+    unlink(sourcePath);
+    free(compiled);
+    return NULL;
+  }
+  close(objectFd);
+  FILE* fp = fdopen(sourceFd, "w");
+  writeCompiledModelSource(model, compiled->hash, fp);
+  fclose(fp);
+
+  int success = runCompiledModelCompiler(sourcePath, objectPath);
+  unlink(sourcePath);
+  // The linker creates the output file anew, with permissions that
+  // depend on the umask
+  if(!success || chmod(objectPath, 0700) != 0 || rename(objectPath, path) != 0) {
+    unlink(objectPath);
+    free(compiled);
+    return NULL;
+  }
+  if(!loadCompiledModel(compiled, path)) {
+    free(compiled);
+    return NULL;
+  }
+  return compiled;
+}
+
+void destroyCompiledModel(CompiledModel* compiled) {
+  dlclose(compiled->handle);
+  free(compiled);
+}
+
+/**
+ * Scores instances with a compiled model.
+ *
+ * @param compiled Compiled model
+ * @param features Feature values, numberOfFeatures per instance
+ * @param numberOfFeatures Number of features of an instance
+ * @param numberOfInstances Number of instances
+ * @param scores Output scores, one per instance
+ */
+void scoreCompiledModel(CompiledModel* compiled, float* features, int numberOfFeatures,
+                        int numberOfInstances, float* scores) {
+  compiled->score(features, numberOfFeatures, numberOfInstances, scores);
+}
+
+#endif
@@ -0,0 +1,297 @@
+/**
+ * QuickScorer: evaluates a tree ensemble feature by feature, rather
+ * than tree by tree.
+ *
+ * The leaves of every tree are numbered from left to right, and each
+ * tree keeps a bitvector of the leaves that can still be reached, with
+ * bit i standing for leaf i. An internal node whose test fails (the
+ * feature value is greater than its threshold, and the instance moves
+ * to the right) rules out every leaf of its left subtree; its mask has
+ * those bits cleared. The exit leaf of a tree is the leftmost leaf that
+ * survives all masks, i.e., its lowest set bit.
+ *
+ * Internal nodes of all trees are grouped by feature and sorted by
+ * threshold, so the failed nodes of a feature are a prefix of its list:
+ * those with a threshold less than the feature value. Scoring an
+ * instance goes through these prefixes, AND-ing masks into bitvectors,
+ * then adds up the values of the exit leaves. Trees with more than 64
+ * leaves take several words per bitvector.
+ *
+ * Scores are identical to those of VPred (findLeaf), tree for tree.
+ *
+ *   QuickScorer* scorer = createQuickScorer(model);
+ *   scoreQuickScorer(scorer, features, numberOfFeatures, numberOfInstances, scores);
+ *   destroyQuickScorer(scorer);
+ */
+
+#ifndef QUICK_SCORER_H_GUARD
+#define QUICK_SCORER_H_GUARD
+
+#include <stdlib.h>
+#include <string.h>
+#include "TreeBuilder.h"
+
+#define QUICK_SCORER_WORD_BITS 64
+// Maximum number of internal nodes in a block of trees
+#define QUICK_SCORER_BLOCK_NODES 8192
+
+typedef struct QuickScorer QuickScorer;
+
+struct QuickScorer {
+  int nbTrees;
+  // Number of words of each bitvector
+  int words;
+  int numberOfFeatures;
+
+  // Trees are split into blocks of consecutive trees, whose nodes and
+  // bitvectors stay in cache while a block of instances goes through
+  // them. Block b holds trees firstTree[b], ..., firstTree[b + 1] - 1.
+  int numberOfBlocks;
+  int* firstTree;
+
+  // Internal nodes, grouped by block, then by feature, and sorted by
+  // threshold: the nodes of feature f in block b are
+  // offsets[b * (numberOfFeatures + 1) + f], ..., offsets[b * (numberOfFeatures + 1) + f + 1] - 1
+  int* offsets;
+  float* thresholds;
+  // Tree of each node, relative to the first tree of its block
+  int* trees;
+  // Mask of each node ("words" words)
+  unsigned long* masks;
+
+  // Value of leaf i of tree t: leaves[t * words * QUICK_SCORER_WORD_BITS + i]
+  float* leaves;
+
+  // Bitvectors of a block of V instances, for a block of trees
+  unsigned long* bitvectors;
+};
+
+typedef struct QuickScorerNode QuickScorerNode;
+
+// An internal node, while nodes are being sorted
+struct QuickScorerNode {
+  int block;
+  int fid;
+  float theta;
+  int tree;
+  // Leaves of the left subtree: first, ..., last - 1
+  int first;
+  int last;
+};
+
+int compareQuickScorerNodes(const void* a, const void* b) {
+  const QuickScorerNode* x = (const QuickScorerNode*) a;
+  const QuickScorerNode* y = (const QuickScorerNode*) b;
+  if(x->block != y->block) {
+    return x->block < y->block ? -1 : 1;
+  }
+  if(x->fid != y->fid) {
+    return x->fid < y->fid ? -1 : 1;
+  }
+  if(x->theta != y->theta) {
+    return x->theta < y->theta ? -1 : 1;
+  }
+  return x->tree < y->tree ? -1 : x->tree > y->tree;
+}
+
+/**
+ * Numbers the leaves of a subtree from left to right, starting at
+ * "leaf," and collects its internal nodes.
+ *
+ * @param nodes Nodes of the tree
+ * @param i Root of the subtree
+ * @param tree Index of the tree within its block
+ * @param leaf Number of the leftmost leaf of the subtree
+ * @param leaves Output leaf values of the tree
+ * @param internal Output internal nodes
+ * @param count Number of internal nodes collected so far
+ * @return Number of leaves numbered so far
+ */
+int collectQuickScorerNodes(Node* nodes, int i, int tree, int leaf, float* leaves,
+                            QuickScorerNode* internal, int* count) {
+  if(nodes[i].children[0] == i && nodes[i].children[1] == i) {
+    leaves[leaf] = nodes[i].theta;
+    return leaf + 1;
+  }
+  QuickScorerNode* node = &internal[(*count)++];
+  node->fid = nodes[i].fid;
+  node->theta = nodes[i].theta;
+  node->tree = tree;
+  node->first = leaf;
+  leaf = collectQuickScorerNodes(nodes, nodes[i].children[0], tree, leaf, leaves,
+                                 internal, count);
+  node->last = leaf;
+  return collectQuickScorerNodes(nodes, nodes[i].children[1], tree, leaf, leaves,
+                                 internal, count);
+}
+
+/**
+ * Counts the leaves of a subtree.
+ */
+int countQuickScorerLeaves(Node* nodes, int i) {
+  if(nodes[i].children[0] == i && nodes[i].children[1] == i) {
+    return 1;
+  }
+  return countQuickScorerLeaves(nodes, nodes[i].children[0]) +
+    countQuickScorerLeaves(nodes, nodes[i].children[1]);
+}
+
+QuickScorer* createQuickScorer(TreeModel* model) {
+  QuickScorer* scorer = (QuickScorer*) malloc(sizeof(QuickScorer));
+  int nbTrees = model->nbTrees;
+  scorer->nbTrees = nbTrees;
+
+  // Split trees into blocks, and find the largest number of leaves
+  int* leaves = (int*) malloc((nbTrees + 1) * sizeof(int));
+  scorer->firstTree = (int*) malloc((nbTrees + 2) * sizeof(int));
+  scorer->numberOfBlocks = 0;
+  int t, maxLeaves = 1, maxTrees = 1, blockNodes = 0;
+  long totalNodes = 0;
+  for(t = 0; t < nbTrees; t++) {
+    leaves[t] = countQuickScorerLeaves(&model->nodes[model->nodeSizes[t]], 0);
+    if(leaves[t] > maxLeaves) {
+      maxLeaves = leaves[t];
+    }
+    if(t == 0 || blockNodes + leaves[t] - 1 > QUICK_SCORER_BLOCK_NODES) {
+      scorer->firstTree[scorer->numberOfBlocks++] = t;
+      blockNodes = 0;
+    }
+    blockNodes += leaves[t] - 1;
+    totalNodes += leaves[t] - 1;
+  }
+  scorer->firstTree[scorer->numberOfBlocks] = nbTrees;
+  int b;
+  for(b = 0; b < scorer->numberOfBlocks; b++) {
+    if(scorer->firstTree[b + 1] - scorer->firstTree[b] > maxTrees) {
+      maxTrees = scorer->firstTree[b + 1] - scorer->firstTree[b];
+    }
+  }
+
+  int words = (maxLeaves + QUICK_SCORER_WORD_BITS - 1) / QUICK_SCORER_WORD_BITS;
+  long bits = words * QUICK_SCORER_WORD_BITS;
+  scorer->words = words;
+  scorer->leaves = (float*) calloc(nbTrees * bits, sizeof(float));
+  scorer->bitvectors = (unsigned long*)
+    malloc(V * (long) maxTrees * words * sizeof(unsigned long));
+
+  QuickScorerNode* internal = (QuickScorerNode*)
+    malloc((totalNodes + 1) * sizeof(QuickScorerNode));
+  int count = 0, n;
+  for(b = 0; b < scorer->numberOfBlocks; b++) {
+    for(t = scorer->firstTree[b]; t < scorer->firstTree[b + 1]; t++) {
+      int first = count;
+      collectQuickScorerNodes(&model->nodes[model->nodeSizes[t]], 0,
+                              t - scorer->firstTree[b], 0, &scorer->leaves[t * bits],
+                              internal, &count);
+      for(n = first; n < count; n++) {
+        internal[n].block = b;
+      }
+    }
+  }
+  qsort(internal, count, sizeof(QuickScorerNode), compareQuickScorerNodes);
+
+  scorer->numberOfFeatures = 0;
+  for(n = 0; n < count; n++) {
+    if(internal[n].fid + 1 > scorer->numberOfFeatures) {
+      scorer->numberOfFeatures = internal[n].fid + 1;
+    }
+  }
+  int stride = scorer->numberOfFeatures + 1;
+  scorer->offsets = (int*) calloc(scorer->numberOfBlocks * stride + 1, sizeof(int));
+  scorer->thresholds = (float*) malloc((count + 1) * sizeof(float));
+  scorer->trees = (int*) malloc((count + 1) * sizeof(int));
+  scorer->masks = (unsigned long*) malloc(((long) count * words + 1) * sizeof(unsigned long));
+  int i;
+  for(n = 0; n < count; n++) {
+    scorer->offsets[internal[n].block * stride + internal[n].fid + 1]++;
+    scorer->thresholds[n] = internal[n].theta;
+    scorer->trees[n] = internal[n].tree;
+    unsigned long* mask = &scorer->masks[(long) n * words];
+    memset(mask, 0xFF, words * sizeof(unsigned long));
+    for(i = internal[n].first; i < internal[n].last; i++) {
+      mask[i / QUICK_SCORER_WORD_BITS] &= ~(1UL << (i % QUICK_SCORER_WORD_BITS));
+    }
+  }
+  // Offsets are running counts across blocks
+  for(n = 0; n < scorer->numberOfBlocks * stride; n++) {
+    scorer->offsets[n + 1] += scorer->offsets[n];
+  }
+  free(internal);
+  free(leaves);
+  return scorer;
+}
+
+void destroyQuickScorer(QuickScorer* scorer) {
+  free(scorer->firstTree);
+  free(scorer->offsets);
+  free(scorer->thresholds);
+  free(scorer->trees);
+  free(scorer->masks);
+  free(scorer->leaves);
+  free(scorer->bitvectors);
+  free(scorer);
+}
+
+/**
+ * Scores instances with the ensemble, V instances at a time.
+ *
+ * @param scorer QuickScorer of the ensemble
+ * @param features Feature values, numberOfFeatures per instance
+ * @param numberOfFeatures Number of features of an instance
+ * @param numberOfInstances Number of instances
+ * @param scores Output scores, one per instance
+ */
+void scoreQuickScorer(QuickScorer* scorer, float* features, int numberOfFeatures,
+                      int numberOfInstances, float* scores) {
+  int words = scorer->words, stride = scorer->numberOfFeatures + 1;
+  long bits = words * QUICK_SCORER_WORD_BITS;
+  unsigned long* bitvectors = scorer->bitvectors;
+  int i, j, b, f, n, t, w;
+  for(i = 0; i < numberOfInstances; i += V) {
+    int m = numberOfInstances - i < V ? numberOfInstances - i : V;
+    for(j = 0; j < m; j++) {
+      scores[i + j] = 0;
+    }
+
+    for(b = 0; b < scorer->numberOfBlocks; b++) {
+      int firstTree = scorer->firstTree[b];
+      long trees = (long) (scorer->firstTree[b + 1] - firstTree) * words;
+      int* offsets = &scorer->offsets[b * stride];
+      memset(bitvectors, 0xFF, m * trees * sizeof(unsigned long));
+
+      // Nodes whose test fails are those with a threshold below the value
+      for(f = 0; f < scorer->numberOfFeatures; f++) {
+        for(j = 0; j < m; j++) {
+          float x = features[(long) (i + j) * numberOfFeatures + f];
+          unsigned long* v = &bitvectors[j * trees];
+          if(words == 1) {
+            for(n = offsets[f]; n < offsets[f + 1] && scorer->thresholds[n] < x; n++) {
+              v[scorer->trees[n]] &= scorer->masks[n];
+            }
+          } else {
+            for(n = offsets[f]; n < offsets[f + 1] && scorer->thresholds[n] < x; n++) {
+              unsigned long* mask = &scorer->masks[(long) n * words];
+              for(w = 0; w < words; w++) {
+                v[scorer->trees[n] * words + w] &= mask[w];
+              }
+            }
+          }
+        }
+      }
+
+      // The exit leaf of each tree is its leftmost remaining leaf
+      for(j = 0; j < m; j++) {
+        float score = scores[i + j];
+        unsigned long* v = &bitvectors[j * trees];
+        for(t = firstTree; t < scorer->firstTree[b + 1]; t++, v += words) {
+          for(w = 0; !v[w]; w++);
+          score += scorer->leaves[t * bits + w * QUICK_SCORER_WORD_BITS +
+                                  __builtin_ctzl(v[w])];
+        }
+        scores[i + j] = score;
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,381 @@
+/**
+ * Structured (Boolean) queries. A query is an operator tree, written in
+ * prefix notation:
+ *
+ *     term                        a single term
+ *     #and( q1 q2 ... )           documents that match all of q1, q2, ...
+ *     #or( q1 q2 ... )            documents that match any of q1, q2, ...
+ *     #not( q )                   excludes documents that match q. Only
+ *                                 allowed within an #and that has at
+ *                                 least one other operand.
+ *     #phrase( t1 t2 ... )        terms t1, t2, ... at consecutive positions
+ *     #odN( t1 t2 ... )           terms t1, t2, ... in this order, each at
+ *                                 most N positions after the previous one
+ *                                 (#phrase is the same as #od1)
+ *     #uwN( t1 t2 ... )           terms t1, t2, ... in any order, within a
+ *                                 window of N positions
+ *     #weight( w1 q1 w2 q2 ... )  like #or, with the score of each operand
+ *                                 multiplied by its weight
+ *
+ * Operators may be nested arbitrarily. A query that consists of several
+ * operands at the top level is treated as their #and. For example:
+ *
+ *     #and( #or(comput machin) #phrase(time share) #not(ibm) )
+ *
+ * Terms that are not in the index match no document.
+ */
+
+#ifndef QUERY_PARSER_H_GUARD
+#define QUERY_PARSER_H_GUARD
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "dictionary/Dictionary.h"
+#include "Pointers.h"
+#include "PostingsList.h"
+
+#define MAX_QUERY_TOKEN 1024
+
+typedef enum QueryOperator QueryOperator;
+enum QueryOperator {
+  QUERY_TERM = 0,
+  QUERY_AND = 1,
+  QUERY_OR = 2,
+  QUERY_NOT = 3,
+  QUERY_WEIGHT = 4,
+  QUERY_ORDERED_WINDOW = 5,
+  QUERY_UNORDERED_WINDOW = 6,
+};
+
+typedef struct QueryNode QueryNode;
+
+struct QueryNode {
+  QueryOperator op;
+  // Term id (QUERY_TERM only), or -1 if the term is not in the index
+  int termid;
+  // Multiplier of the score of this node in its parent
+  float weight;
+  // Size of the window (#od and #uw only)
+  int window;
+  QueryNode** children;
+  int numberOfChildren;
+  // Estimated number of matching documents, derived from df
+  unsigned int cost;
+
+  // Evaluation state, set up for every evaluation of the query:
+  // the cursor of a term, and the current document of the node
+  Cursor* cursor;
+  unsigned int docid;
+  int valid;
+  // Number of window occurrences in the current document
+  int tf;
+  // Positions of each term of a window in the current document (spans
+  // of the cursors' position caches), and the number of positions
+  unsigned int** positions;
+  int* positionsCount;
+};
+
+QueryNode* createQueryNode(QueryOperator op) {
+  QueryNode* node = (QueryNode*) calloc(1, sizeof(QueryNode));
+  node->op = op;
+  node->termid = -1;
+  node->weight = 1;
+  return node;
+}
+
+void destroyQueryNode(QueryNode* node) {
+  int i;
+  for(i = 0; i < node->numberOfChildren; i++) {
+    destroyQueryNode(node->children[i]);
+  }
+  if(node->children) {
+    free(node->children);
+  }
+  free(node);
+}
+
+void addChildQueryNode(QueryNode* node, QueryNode* child) {
+  node->children = (QueryNode**) realloc(node->children,
+                                         (node->numberOfChildren + 1) * sizeof(QueryNode*));
+  node->children[node->numberOfChildren++] = child;
+}
+
+/**
+ * Reads the next token, which is either a parenthesis or a run of
+ * characters up to the next space or parenthesis.
+ *
+ * @param text Query text. Moves past the token.
+ * @param token Output token, of at most MAX_QUERY_TOKEN characters
+ * @return Length of the token, or 0 at the end of the text
+ */
+int nextQueryToken(char** text, char* token) {
+  char* p = *text;
+  while(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+    p++;
+  }
+  int length = 0;
+  if(*p == '(' || *p == ')') {
+    token[length++] = *p++;
+  } else {
+    while(*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r' &&
+          *p != '(' && *p != ')' && length < MAX_QUERY_TOKEN - 1) {
+      token[length++] = *p++;
+    }
+  }
+  token[length] = 0;
+  *text = p;
+  return length;
+}
+
+/**
+ * Parses a single operand. Returns NULL on syntax errors.
+ */
+QueryNode* parseQueryNode(char** text, Dictionary** dictionary, Pointers* pointers) {
+  char token[MAX_QUERY_TOKEN];
+  if(!nextQueryToken(text, token) || token[0] == '(' || token[0] == ')') {
+    return NULL;
+  }
+
+  if(token[0] != '#') {
+    QueryNode* node = createQueryNode(QUERY_TERM);
+    node->termid = getTermId(dictionary, token);
+    if(node->termid >= 0 &&
+       getHeadPointer(pointers, node->termid) == UNDEFINED_POINTER) {
+      node->termid = -1;
+    }
+    return node;
+  }
+
+  QueryOperator op;
+  int window = 0;
+  char* end = NULL;
+  if(!strcmp(token, "#and")) {
+    op = QUERY_AND;
+  } else if(!strcmp(token, "#or")) {
+    op = QUERY_OR;
+  } else if(!strcmp(token, "#not")) {
+    op = QUERY_NOT;
+  } else if(!strcmp(token, "#phrase")) {
+    op = QUERY_ORDERED_WINDOW;
+    window = 1;
+  } else if(!strcmp(token, "#weight")) {
+    op = QUERY_WEIGHT;
+  } else if(!strncmp(token, "#od", 3)) {
+    op = QUERY_ORDERED_WINDOW;
+    window = strtol(&token[3], &end, 10);
+  } else if(!strncmp(token, "#uw", 3)) {
+    op = QUERY_UNORDERED_WINDOW;
+    window = strtol(&token[3], &end, 10);
+  } else {
+    return NULL;
+  }
+  if((end && (end == &token[3] || *end || window < 1)) ||
+     !nextQueryToken(text, token) || token[0] != '(') {
+    return NULL;
+  }
+
+  QueryNode* node = createQueryNode(op);
+  node->window = window;
+  int positional = op == QUERY_ORDERED_WINDOW || op == QUERY_UNORDERED_WINDOW;
+  while(1) {
+    char* next = *text;
+    if(!nextQueryToken(&next, token)) {
+      destroyQueryNode(node);
+      return NULL;
+    }
+    if(token[0] == ')') {
+      *text = next;
+      break;
+    }
+
+    float weight = 1;
+    if(op == QUERY_WEIGHT) {
+      nextQueryToken(text, token);
+      weight = strtof(token, &end);
+      if(end == token || *end) {
+        destroyQueryNode(node);
+        return NULL;
+      }
+    }
+    QueryNode* child = parseQueryNode(text, dictionary, pointers);
+    // Windows are made of terms
+    if(!child || (positional && child->op != QUERY_TERM)) {
+      if(child) destroyQueryNode(child);
+      destroyQueryNode(node);
+      return NULL;
+    }
+    child->weight = weight;
+    addChildQueryNode(node, child);
+  }
+
+  if(node->numberOfChildren == 0 ||
+     (op == QUERY_NOT && node->numberOfChildren != 1)) {
+    destroyQueryNode(node);
+    return NULL;
+  }
+  return node;
+}
+
+/**
+ * Whether #not operators only appear within an #and that has at least
+ * one other (positive) operand.
+ */
+int isValidQueryNode(QueryNode* node) {
+  int i, positive = 0;
+  for(i = 0; i < node->numberOfChildren; i++) {
+    QueryNode* child = node->children[i];
+    if(child->op == QUERY_NOT) {
+      if(node->op != QUERY_AND) {
+        return 0;
+      }
+    } else {
+      positive++;
+    }
+    if(!isValidQueryNode(child)) {
+      return 0;
+    }
+  }
+  return node->op != QUERY_AND || positive > 0;
+}
+
+/**
+ * Estimates the number of documents each node matches, and orders the
+ * operands of #and by increasing cost, so that the rarest operand
+ * drives the intersection. #not operands are moved last: they are only
+ * tested against documents that match all other operands.
+ */
+unsigned int computeQueryCost(QueryNode* node, Pointers* pointers) {
+  int i, j;
+  if(node->op == QUERY_TERM) {
+    node->cost = node->termid >= 0 ? getDf(pointers, node->termid) : 0;
+    return node->cost;
+  }
+
+  for(i = 0; i < node->numberOfChildren; i++) {
+    computeQueryCost(node->children[i], pointers);
+  }
+
+  if(node->op == QUERY_AND) {
+    for(i = 1; i < node->numberOfChildren; i++) {
+      QueryNode* child = node->children[i];
+      for(j = i - 1; j >= 0; j--) {
+        QueryNode* other = node->children[j];
+        int notChild = child->op == QUERY_NOT, notOther = other->op == QUERY_NOT;
+        if(notOther < notChild || (notOther == notChild && other->cost <= child->cost)) {
+          break;
+        }
+        node->children[j + 1] = other;
+      }
+      node->children[j + 1] = child;
+    }
+  }
+
+  if(node->op == QUERY_OR || node->op == QUERY_WEIGHT) {
+    unsigned long sum = 0;
+    for(i = 0; i < node->numberOfChildren; i++) {
+      sum += node->children[i]->cost;
+    }
+    node->cost = sum > 0xFFFFFFFF ? 0xFFFFFFFF : sum;
+  } else if(node->op == QUERY_NOT) {
+    node->cost = node->children[0]->cost;
+  } else {
+    // Conjunctions match no more documents than their rarest operand
+    node->cost = 0xFFFFFFFF;
+    for(i = 0; i < node->numberOfChildren; i++) {
+      if(node->children[i]->op != QUERY_NOT && node->children[i]->cost < node->cost) {
+        node->cost = node->children[i]->cost;
+      }
+    }
+  }
+  return node->cost;
+}
+
+/**
+ * Parses a structured query.
+ *
+ * @param text Query text
+ * @param dictionary Dictionary of the index
+ * @param pointers Pointers of the index
+ * @return Root of the operator tree, or NULL if the query is malformed
+ */
+QueryNode* parseQuery(char* text, Dictionary** dictionary, Pointers* pointers) {
+  char token[MAX_QUERY_TOKEN];
+  QueryNode* root = createQueryNode(QUERY_AND);
+  char* next = text;
+  while(nextQueryToken(&next, token)) {
+    QueryNode* child = parseQueryNode(&text, dictionary, pointers);
+    if(!child) {
+      destroyQueryNode(root);
+      return NULL;
+    }
+    addChildQueryNode(root, child);
+    next = text;
+  }
+  if(root->numberOfChildren == 0) {
+    destroyQueryNode(root);
+    return NULL;
+  }
+
+  // A single operand needs no enclosing #and
+  if(root->numberOfChildren == 1) {
+    QueryNode* child = root->children[0];
+    root->numberOfChildren = 0;
+    destroyQueryNode(root);
+    root = child;
+    root->weight = 1;
+  }
+
+  if(root->op == QUERY_NOT || !isValidQueryNode(root)) {
+    destroyQueryNode(root);
+    return NULL;
+  }
+  computeQueryCost(root, pointers);
+  return root;
+}
+
+/**
+ * Collects the ids of the terms of the query that may contribute to a
+ * match (that is, outside of #not operators), e.g., to extract features.
+ *
+ * @param node Root of the operator tree
+ * @param terms Output term ids
+ * @param length Number of term ids written so far
+ * @param max Capacity of "terms"
+ * @return Number of term ids written
+ */
+int collectQueryTerms(QueryNode* node, int* terms, int length, int max) {
+  if(node->op == QUERY_NOT) {
+    return length;
+  }
+  if(node->op == QUERY_TERM) {
+    if(node->termid >= 0 && length < max) {
+      terms[length++] = node->termid;
+    }
+    return length;
+  }
+  int i;
+  for(i = 0; i < node->numberOfChildren; i++) {
+    length = collectQueryTerms(node->children[i], terms, length, max);
+  }
+  return length;
+}
+
+/**
+ * Whether the query contains phrases or windows, which require a
+ * positional index.
+ */
+int requiresPositions(QueryNode* node) {
+  if(node->op == QUERY_ORDERED_WINDOW || node->op == QUERY_UNORDERED_WINDOW) {
+    return 1;
+  }
+  int i;
+  for(i = 0; i < node->numberOfChildren; i++) {
+    if(requiresPositions(node->children[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+#endif